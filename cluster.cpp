@@ -0,0 +1,132 @@
+#include <string.h>
+#include <math.h>
+
+#include <limits>
+#include <algorithm>
+#include <unordered_map>
+
+#include "cluster.h"
+
+void build_clusters(std::vector<Cluster> &clusters, unsigned int *indices, const std::vector<unsigned int> &group_sizes,
+    const Vec3f *verts, size_t nverts) {
+    size_t nfaces = 0;
+    for (unsigned int i = 0; i < group_sizes.size(); i++) nfaces += group_sizes[i];
+
+    // Vertices split by their normals or uvs are still neighbours
+    std::vector<unsigned int> remap(nverts);
+    std::unordered_map<PositionKey, unsigned int, PositionKeyHash> positions;
+    positions.reserve(nverts);
+    for (size_t v = 0; v < nverts; v++) {
+        remap[v] = positions.insert(std::make_pair(PositionKey(verts[v]), (unsigned int)v)).first->second;
+    }
+
+    // Faces around each vertex position
+    std::vector<unsigned int> offsets(nverts + 1);
+    for (size_t i = 0; i < nfaces * 3; i++) offsets[remap[indices[i]] + 1]++;
+    for (size_t v = 0; v < nverts; v++) offsets[v + 1] += offsets[v];
+    std::vector<unsigned int> adjacent(nfaces * 3);
+    std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < nfaces * 3; i++) adjacent[fill[remap[indices[i]]]++] = i / 3;
+
+    std::vector<bool> used(nfaces);
+    std::vector<unsigned int> queued(nfaces, ~0u); // by the cluster with this number
+    std::vector<unsigned int> order, queue;
+    std::vector<unsigned int> reordered;
+    unsigned int first = 0;
+    for (unsigned int g = 0; g < group_sizes.size(); g++) {
+        const unsigned int end = first + group_sizes[g];
+        order.clear();
+        queue.clear();
+        unsigned int next = first;
+        size_t head = 0;
+        while (order.size() < group_sizes[g]) {
+            // Go on from where the last cluster stopped growing, so the
+            // clusters sweep over the surface rather than leave holes in it
+            unsigned int seed = end;
+            for (; head < queue.size() && seed == end; head++) {
+                if (!used[queue[head]]) seed = queue[head];
+            }
+            while (seed == end && used[next]) next++;
+            if (seed == end) seed = next;
+
+            Cluster cluster;
+            cluster.first_face = order.size() + first;
+            queue.assign(1, seed);
+            // Breadth first from the seed, for a patch that is about as wide as long
+            for (head = 0; head < queue.size() && cluster.nfaces < CLUSTER_MAX_FACES; head++) {
+                unsigned int f = queue[head];
+                if (used[f]) continue;
+                used[f] = true;
+                order.push_back(f);
+                cluster.nfaces++;
+                for (int j = 0; j < 3; j++) {
+                    unsigned int v = remap[indices[f * 3 + j]];
+                    for (unsigned int k = offsets[v]; k < offsets[v + 1]; k++) {
+                        unsigned int n = adjacent[k];
+                        if (n < first || n >= end || used[n] || queued[n] == clusters.size()) continue;
+                        queued[n] = clusters.size();
+                        queue.push_back(n);
+                    }
+                }
+            }
+            clusters.push_back(cluster);
+        }
+
+        reordered.resize(order.size() * 3);
+        for (unsigned int i = 0; i < order.size(); i++) {
+            memcpy(&reordered[i * 3], &indices[order[i] * 3], 3 * sizeof(unsigned int));
+        }
+        memcpy(&indices[first * 3], reordered.data(), reordered.size() * sizeof(unsigned int));
+        first = end;
+    }
+}
+
+void compute_cluster_bounds(std::vector<Cluster> &clusters, const unsigned int *indices, const Vec3f *verts, bool flip) {
+    std::vector<Vec3f> normals;
+    for (unsigned int c = 0; c < clusters.size(); c++) {
+        Cluster &cluster = clusters[c];
+        const unsigned int *face = indices + cluster.first_face * 3;
+        const unsigned int count = cluster.nfaces * 3;
+
+        Vec3f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+        Vec3f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+        for (unsigned int i = 0; i < count; i++) {
+            for (int k = 0; k < 3; k++) {
+                bboxmin[k] = std::min(bboxmin[k], verts[face[i]][k]);
+                bboxmax[k] = std::max(bboxmax[k], verts[face[i]][k]);
+            }
+        }
+        cluster.center = (bboxmin + bboxmax) * .5f;
+        float radius = 0;
+        for (unsigned int i = 0; i < count; i++) {
+            radius = std::max(radius, (verts[face[i]] - cluster.center).norm());
+        }
+        // Rounding in the renderer's transforms should not make a face poke out
+        cluster.radius = radius * (1 + 1e-5f);
+
+        // Faces without an area cover no pixels and do not count
+        normals.clear();
+        Vec3f axis;
+        for (unsigned int i = 0; i < count; i += 3) {
+            const Vec3f &a = verts[face[i]], &b = verts[face[i + 1]], &c = verts[face[i + 2]];
+            Vec3f n = cross(b - a, c - a);
+            float l = n.norm();
+            if (!(l > 0)) continue;
+            n = n / (flip ? -l : l);
+            normals.push_back(n);
+            axis = axis + n;
+        }
+        cluster.cone_axis = Vec3f();
+        cluster.cone_cutoff = 1;
+        float l = axis.norm();
+        if (normals.empty() || !(l > 0)) continue;
+        axis = axis / l;
+        float mindp = 1;
+        for (unsigned int i = 0; i < normals.size(); i++) mindp = std::min(mindp, normals[i] * axis);
+        // Some slack for the rounding of the normals
+        mindp -= 1e-3f;
+        if (mindp <= 0) continue;
+        cluster.cone_axis = axis;
+        cluster.cone_cutoff = sqrtf(1 - mindp * mindp);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Tiny Renderer, https://github.com/ssloy/tinyrenderer
+ * Copyright Dmitry V. Sokolov
+ * zlib license
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not
+ *    be misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#pragma once
+
+#ifndef CLUSTER_H_FB9A7858_CB5C_11F1_9159_02FC00000001
+#define CLUSTER_H_FB9A7858_CB5C_11F1_9159_02FC00000001
+
+#include <stddef.h>
+
+#include <vector>
+
+#include "geometry.h"
+
+// Most faces in a cluster
+const unsigned int CLUSTER_MAX_FACES = 128;
+
+// A run of neighbouring faces, with bounds to skip all of them at once
+struct Cluster {
+    unsigned int first_face;
+    unsigned int nfaces;
+    Vec3f center;      // bounding sphere
+    float radius;
+    Vec3f cone_axis;   // every face normal is in the cone around cone_axis
+    float cone_cutoff; // sine of the widest angle of a face normal to cone_axis, 1 if some face may point any way
+
+    Cluster() : first_face(0), nfaces(0), radius(0), cone_cutoff(1) {}
+};
+
+// Reorders the faces in indices so that they come in clusters of up to
+// CLUSTER_MAX_FACES faces sharing vertices, or vertex positions, with each
+// other, and appends the clusters to clusters. Faces stay in their group, the
+// groups being runs of group_sizes[i] faces one after the other, so a cluster
+// only has faces of one group. The bounds are left for
+// compute_cluster_bounds().
+void build_clusters(std::vector<Cluster> &clusters, unsigned int *indices, const std::vector<unsigned int> &group_sizes,
+    const Vec3f *verts, size_t nverts);
+
+// Bounding sphere and normal cone of each cluster, the face normals
+// following the winding of indices, or going the other way with flip
+void compute_cluster_bounds(std::vector<Cluster> &clusters, const unsigned int *indices, const Vec3f *verts, bool flip = false);
+
+#endif // CLUSTER_H_FB9A7858_CB5C_11F1_9159_02FC00000001
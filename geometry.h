@@ -28,6 +28,8 @@
 #define GEOMETRY_H_F3EC360C_8881_11EA_90FA_10FEED04CD1C
 
 #include <cmath>
+#include <cstring>
+#include <stdint.h>
 #include <vector>
 #include <cassert>
 #include <iostream>
@@ -245,4 +247,19 @@ typedef vec<3,  int>   Vec3i;
 typedef vec<4,  float> Vec4f;
 typedef mat<4,4,float> Matrix;
 
+// Bit pattern of a position, to find vertices in the same place. Compared
+// bit for bit, so that equal keys always hash the same, -0 and 0 included
+struct PositionKey {
+    uint32_t bits[3];
+
+    explicit PositionKey(const Vec3f &p) { memcpy(bits, &p[0], sizeof(bits)); }
+    bool operator==(const PositionKey &other) const { return !memcmp(bits, other.bits, sizeof(bits)); }
+};
+
+struct PositionKeyHash {
+    size_t operator()(const PositionKey &key) const {
+        return (key.bits[0] * 73856093u) ^ (key.bits[1] * 19349663u) ^ (key.bits[2] * 83492791u);
+    }
+};
+
 #endif // GEOMETRY_H_F3EC360C_8881_11EA_90FA_10FEED04CD1C
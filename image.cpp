@@ -3,6 +3,9 @@
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <utility>
+#include <new>
+#include <stdlib.h>
 
 #include "image.h"
 
@@ -12,38 +15,119 @@
 #define SVPNG_LINKAGE static
 #include "save_png.h"
 
-Image::Image() : data(NULL), width(0), height(0), bytespp(0) {}
+ImagePool::~ImagePool() {
+    clear();
+}
+
+unsigned char *ImagePool::acquire(size_t nbytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::multimap<size_t, unsigned char *>::iterator it = buffers.find(nbytes);
+    if (it == buffers.end()) return NULL;
+    unsigned char *buffer = it->second;
+    buffers.erase(it);
+    return buffer;
+}
+
+void ImagePool::release(unsigned char *buffer, size_t nbytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffers.insert(std::make_pair(nbytes, buffer));
+}
+
+void ImagePool::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto & b : buffers) free(b.second);
+    buffers.clear();
+}
+
+unsigned char *Image::allocate(size_t nbytes, ImagePool *pool) {
+    if (!nbytes) return NULL;
+    if (pool) {
+        unsigned char *buffer = pool->acquire(nbytes);
+        if (buffer) return buffer;
+    }
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, ALIGNMENT, nbytes)) {
+        throw std::bad_alloc();
+    }
+    return (unsigned char *)buffer;
+}
+
+void Image::release() {
+    if (data) {
+        if (deleter) deleter(data);
+        else if (pool) pool->release(data, (size_t)width*height*bytespp);
+        else free(data);
+    }
+    data = NULL;
+    deleter = nullptr;
+}
+
+void Image::adopt(unsigned char *buffer, int w, int h, int bpp, const std::function<void(unsigned char *)> &free_buffer) {
+    release();
+    data = buffer;
+    width = w;
+    height = h;
+    bytespp = bpp;
+    deleter = free_buffer;
+}
+
+Image::Image() : data(NULL), width(0), height(0), bytespp(0), pool(NULL) {}
 
-Image::Image(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp) {
-    unsigned long nbytes = width*height*bytespp;
-    data = new unsigned char[nbytes];
-    memset(data, 0, nbytes);
+Image::Image(int w, int h, int bpp, Init init, ImagePool *pool) : data(NULL), width(w), height(h), bytespp(bpp), pool(pool) {
+    size_t nbytes = (size_t)width*height*bytespp;
+    data = allocate(nbytes, pool);
+    if (init == ZEROED && data) memset(data, 0, nbytes);
 }
 
-Image::Image(const Image &img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp) {
-    unsigned long nbytes = width*height*bytespp;
-    data = new unsigned char[nbytes];
-    memcpy(data, img.data, nbytes);
+Image::Image(const Image &img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp), pool(img.pool) {
+    size_t nbytes = (size_t)width*height*bytespp;
+    data = allocate(nbytes, pool);
+    if (data) memcpy(data, img.data, nbytes);
+}
+
+Image::Image(Image &&img) : data(img.data), width(img.width), height(img.height), bytespp(img.bytespp), pool(img.pool), deleter(std::move(img.deleter)) {
+    img.data = NULL;
+    img.deleter = nullptr;
+    img.width = img.height = img.bytespp = 0;
 }
 
 Image::~Image() {
-    if (data) delete [] data;
+    release();
 }
 
 Image & Image::operator =(const Image &img) {
     if (this != &img) {
-        if (data) delete [] data;
+        size_t nbytes = (size_t)img.width*img.height*img.bytespp;
+        if (nbytes != (size_t)width*height*bytespp) {
+            release();
+            data = allocate(nbytes, pool);
+        }
         width  = img.width;
         height = img.height;
         bytespp = img.bytespp;
-        unsigned long nbytes = width*height*bytespp;
-        data = new unsigned char[nbytes];
-        memcpy(data, img.data, nbytes);
+        if (data) memcpy(data, img.data, nbytes);
     }
     return *this;
 }
 
-ImageColor Image::get(int x, int y) {
+Image & Image::operator =(Image &&img) {
+    if (this != &img) {
+        Image tmp(std::move(img));
+        swap(tmp);
+    }
+    return *this;
+}
+
+void Image::swap(Image &img) {
+    std::swap(data, img.data);
+    std::swap(width, img.width);
+    std::swap(height, img.height);
+    std::swap(bytespp, img.bytespp);
+    std::swap(pool, img.pool);
+    std::swap(deleter, img.deleter);
+}
+
+ImageColor Image::get(int x, int y) const {
     if (!data || x<0 || y<0 || x>=width || y>=height) {
         return ImageColor();
     }
@@ -69,28 +153,31 @@ bool Image::set(int x, int y, const ImageColor &c) {
     return true;
 }
 
-int Image::get_bytespp() {
+int Image::get_bytespp() const {
     return bytespp;
 }
 
-int Image::get_width() {
+int Image::get_width() const {
     return width;
 }
 
-int Image::get_height() {
+int Image::get_height() const {
     return height;
 }
 
+template <typename Format> static void flip_rows(ImageView<Format> v) {
+    for (int j=0; j<v.height; j++) {
+        reverse(v.span(j));
+    }
+}
+
 bool Image::flip_horizontally() {
     if (!data) return false;
-    int half = width>>1;
-    for (int i=0; i<half; i++) {
-        for (int j=0; j<height; j++) {
-            ImageColor c1 = get(i, j);
-            ImageColor c2 = get(width-1-i, j);
-            set(i, j, c2);
-            set(width-1-i, j, c1);
-        }
+    switch (bytespp) {
+        case GRAYSCALE: flip_rows(view<Gray8>()); break;
+        case RGB:       flip_rows(view<RGB8>());  break;
+        case RGBA:      flip_rows(view<RGBA8>()); break;
+        default:        return false;
     }
     return true;
 }
@@ -115,13 +202,17 @@ unsigned char *Image::buffer() {
     return data;
 }
 
+const unsigned char *Image::buffer() const {
+    return data;
+}
+
 void Image::clear() {
     memset((void *)data, 0, width*height*bytespp);
 }
 
-bool Image::scale(int w, int h) {
+bool Image::scale_nearest(int w, int h) {
     if (w<=0 || h<=0 || !data) return false;
-    unsigned char *tdata = new unsigned char[w*h*bytespp];
+    unsigned char *tdata = allocate((size_t)w*h*bytespp, pool);
     int nscanline = 0;
     int oscanline = 0;
     int erry = 0;
@@ -149,7 +240,7 @@ bool Image::scale(int w, int h) {
             nscanline += nlinebytes;
         }
     }
-    delete [] data;
+    release();
     data = tdata;
     width = w;
     height = h;
@@ -160,52 +251,51 @@ bool Image::modify_opacity(double opacity) {
     if (bytespp != RGBA) {
         return false;
     }
-    for (int i=0; i<width; i++) {
-        for (int j=0; j<height; j++) {
-            ImageColor c = get(i, j);
-            c.rgba[3] = (unsigned char)(double(c.rgba[3]) * opacity);
-            set(i, j, c);
-        }
+    uint8_t table[256];
+    for (int a=0; a<256; a++) {
+        table[a] = (unsigned char)(double(a) * opacity);
+    }
+    ImageView<RGBA8> v = view<RGBA8>();
+    for (int j=0; j<height; j++) {
+        remap_channel(v.span(j), 3, table);
     }
     return true;
 }
 
 void Image::set_to_color(const ImageColor color) {
-    if (data) delete [] data;
+    release();
     width = height = 1;
     bytespp = color.bytespp;
     unsigned long nbytes = bytespp * width * height;
-    data = new unsigned char[nbytes];
+    data = allocate(nbytes, pool);
     memcpy(data, color.rgba, nbytes);
 }
 
-static const char hex_digits[] = "0123456789ABCDEF";
+static void free_stb_buffer(unsigned char *buffer) {
+    stbi_image_free(buffer);
+}
 
-bool Image::read_from_file(const char *filename) {
-    if (data) delete [] data;
-    data = NULL;
+bool Image::read_from_file(const char *filename, bool flip_vertically) {
+    release();
     width = height = bytespp = 0;
 
-    unsigned char *pixel_data = stbi_load(filename, &width, &height, &bytespp, 0);
+    // stb flips while it still has the pixels at hand; the flag is per thread
+    // so that concurrent loads do not interfere
+    stbi_set_flip_vertically_on_load_thread(flip_vertically ? 1 : 0);
+    int w, h, bpp;
+    unsigned char *pixel_data = stbi_load(filename, &w, &h, &bpp, 0);
 
-    if (!pixel_data || (bytespp!=GRAYSCALE && bytespp!=RGB && bytespp!=RGBA)) {
+    if (!pixel_data) {
+        return false;
+    }
+    if (bpp!=GRAYSCALE && bpp!=RGB && bpp!=RGBA) {
+        stbi_image_free(pixel_data);
         return false;
     }
-    //~ puts("\n");
-
-    unsigned long nbytes = bytespp * width * height;
-    data = new unsigned char[nbytes];
-    memcpy(data, pixel_data, nbytes);
-
-    //~ for (unsigned int n = 0; n < 32; n++) {
-    //~     unsigned char c = data[n];
-    //~     putc(hex_digits[c >> 4], stdout);
-    //~     putc(hex_digits[c & 15], stdout);
-    //~     putc(' ', stdout);
-    //~ }
-    //~ puts("\n");
 
-    stbi_image_free(pixel_data);
+    // The decoded buffer becomes the image buffer as is. It comes from malloc,
+    // so it is only aligned to 16 bytes rather than ALIGNMENT.
+    adopt(pixel_data, w, h, bpp, free_stb_buffer);
 
     //~ std::cerr << width << "x" << height << "/" << bytespp*8 << "\n";
     return true;
@@ -217,12 +307,13 @@ bool Image::write_to_file(const char *filename) {
     }
 
     FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        return false;
+    }
     if (bytespp == RGB) {
         svpng(fp, width, height, data, 0);
     } else if (bytespp == RGBA) {
         svpng(fp, width, height, data, 1);
     }
-    fclose(fp);
-
-    return true;
+    return fclose(fp) == 0;
 }
\ No newline at end of file
@@ -28,6 +28,11 @@
 #define IMAGE_H_F3EC386E_8881_11EA_90FD_10FEED04CD1C
 
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <functional>
+
+#include "image_view.h"
 
 struct ImageColor {
     unsigned char rgba[4];
@@ -82,41 +87,93 @@ struct ImageColor {
 
 };
 
+// Keeps released pixel buffers around so that images of the same size
+// (typically the framebuffers of consecutive renders) can reuse them instead
+// of allocating and page-faulting in fresh memory every time.
+class ImagePool {
+public:
+    ImagePool() {}
+    ~ImagePool();
+    unsigned char *acquire(size_t nbytes);
+    void release(unsigned char *buffer, size_t nbytes);
+    void clear();
+
+private:
+    ImagePool(const ImagePool &);
+    ImagePool & operator =(const ImagePool &);
+
+    std::mutex mutex;
+    std::multimap<size_t, unsigned char *> buffers;
+};
+
 class Image {
 protected:
     unsigned char* data;
     int width;
     int height;
     int bytespp;
+    ImagePool *pool;
+    std::function<void(unsigned char *)> deleter; // set for adopted buffers
+
+    static unsigned char *allocate(size_t nbytes, ImagePool *pool);
+    void release();
+    bool scale_nearest(int w, int h);
 
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
     };
 
+    enum Init {
+        ZEROED,         // the buffer is cleared to 0
+        UNINITIALIZED   // the caller is going to overwrite every pixel
+    };
+
+    enum Filter {
+        NEAREST,    // pixel replication / dropping
+        BOX,        // area averaging, the one to use for reductions
+        BILINEAR    // 2x2 interpolation around the sample center
+    };
+
+    static const size_t ALIGNMENT = 64; // pixel buffers start on a cache line
+
     Image();
-    Image(int w, int h, int bpp);
+    Image(int w, int h, int bpp, Init init = ZEROED, ImagePool *pool = NULL);
     Image(const Image &img);
+    Image(Image &&img);
 
-    bool read_from_file(const char *filename);
+    // Decodes the file straight into the image buffer, optionally with the
+    // bottom row first
+    bool read_from_file(const char *filename, bool flip_vertically = false);
     bool write_to_file(const char *filename);
 
     void set_to_color(const ImageColor color);
 
     bool flip_horizontally();
     bool flip_vertically();
-    bool scale(int w, int h);
+    bool scale(int w, int h, Filter filter = BOX);
     bool modify_opacity(double opacity);
-    ImageColor get(int x, int y);
+    ImageColor get(int x, int y) const;
     bool set(int x, int y, ImageColor &c);
     bool set(int x, int y, const ImageColor &c);
     ~Image();
     Image & operator =(const Image &img);
-    int get_width();
-    int get_height();
-    int get_bytespp();
+    Image & operator =(Image &&img);
+    void swap(Image &img);
+    // Takes ownership of an existing w x h buffer, released with deleter
+    void adopt(unsigned char *buffer, int w, int h, int bpp, const std::function<void(unsigned char *)> &deleter);
+    int get_width() const;
+    int get_height() const;
+    int get_bytespp() const;
     unsigned char *buffer();
+    const unsigned char *buffer() const;
     void clear();
+
+    // Typed access to the pixels; Format::Pixel has to be bytespp bytes wide
+    template <typename Format> ImageView<Format> view() {
+        assert(sizeof(typename Format::Pixel) == (size_t)bytespp);
+        return ImageView<Format>(data, width, height);
+    }
 };
 
 #endif // IMAGE_H_F3EC386E_8881_11EA_90FD_10FEED04CD1C
@@ -0,0 +1,176 @@
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "image.h"
+#include "parallel.h"
+
+// Output rows handed to a thread at a time
+static const int ROWS_PER_TASK = 16;
+
+// Separable filter taps: destination sample i is the sum of
+// weight[k] * source[index[k]] for k in [offset[i], offset[i+1])
+struct Taps {
+    std::vector<int> offset;
+    std::vector<int> index;
+    std::vector<float> weight;
+};
+
+// Area averaging: every source sample contributes by how much of it falls
+// under the destination sample
+static void box_taps(int src, int dst, Taps &t) {
+    double ratio = double(src) / dst;
+    for (int i=0; i<dst; i++) {
+        t.offset.push_back((int)t.index.size());
+        double a = i * ratio;
+        double b = (i + 1) * ratio;
+        int first = (int)floor(a);
+        int last = std::min(src - 1, (int)ceil(b) - 1);
+        for (int s=first; s<=last; s++) {
+            double w = (std::min(b, s + 1.) - std::max(a, (double)s)) / ratio;
+            if (w <= 0) continue;
+            t.index.push_back(s);
+            t.weight.push_back((float)w);
+        }
+    }
+    t.offset.push_back((int)t.index.size());
+}
+
+// Linear interpolation between the two source samples around the
+// destination sample center, clamped at the borders
+static void bilinear_taps(int src, int dst, Taps &t) {
+    double ratio = double(src) / dst;
+    for (int i=0; i<dst; i++) {
+        t.offset.push_back((int)t.index.size());
+        double c = (i + .5) * ratio - .5;
+        int s0 = (int)floor(c);
+        float f = (float)(c - s0);
+        t.index.push_back(std::max(0, std::min(src - 1, s0)));
+        t.weight.push_back(1.f - f);
+        t.index.push_back(std::max(0, std::min(src - 1, s0 + 1)));
+        t.weight.push_back(f);
+    }
+    t.offset.push_back((int)t.index.size());
+}
+
+// acc[i] += w * src[i]
+static void accumulate_row(float *acc, const unsigned char *src, float w, int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 vw = _mm_set1_ps(w);
+    for (; i+16<=n; i+=16) {
+        __m128i b  = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i lo = _mm_unpacklo_epi8(b, zero);
+        __m128i hi = _mm_unpackhi_epi8(b, zero);
+        __m128 f0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+        __m128 f1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+        __m128 f2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+        __m128 f3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+        _mm_storeu_ps(acc + i,      _mm_add_ps(_mm_loadu_ps(acc + i),      _mm_mul_ps(f0, vw)));
+        _mm_storeu_ps(acc + i + 4,  _mm_add_ps(_mm_loadu_ps(acc + i + 4),  _mm_mul_ps(f1, vw)));
+        _mm_storeu_ps(acc + i + 8,  _mm_add_ps(_mm_loadu_ps(acc + i + 8),  _mm_mul_ps(f2, vw)));
+        _mm_storeu_ps(acc + i + 12, _mm_add_ps(_mm_loadu_ps(acc + i + 12), _mm_mul_ps(f3, vw)));
+    }
+#endif
+    for (; i<n; i++) acc[i] += w * src[i];
+}
+
+static inline unsigned char to_byte(float v) {
+    v += .5f;
+    return (unsigned char)(v < 0.f ? 0.f : (v > 255.f ? 255.f : v));
+}
+
+// Vertical pass into a float row, then horizontal pass into the destination
+static void resample(const unsigned char *src, int sw, int sh, unsigned char *dst, int dw, int dh, int bpp, Image::Filter filter) {
+    Taps tx, ty;
+    if (filter == Image::BILINEAR) {
+        bilinear_taps(sw, dw, tx);
+        bilinear_taps(sh, dh, ty);
+    } else {
+        box_taps(sw, dw, tx);
+        box_taps(sh, dh, ty);
+    }
+
+    const int srow = sw * bpp;
+    const int drow = dw * bpp;
+    parallel_for(0, dh, ROWS_PER_TASK, [&](int y0, int y1) {
+        std::vector<float> acc(srow);
+        for (int y=y0; y<y1; y++) {
+            std::fill(acc.begin(), acc.end(), 0.f);
+            for (int k=ty.offset[y]; k<ty.offset[y+1]; k++) {
+                accumulate_row(acc.data(), src + (size_t)ty.index[k]*srow, ty.weight[k], srow);
+            }
+            unsigned char *out = dst + (size_t)y*drow;
+            for (int x=0; x<dw; x++) {
+                float sum[4] = { 0.f, 0.f, 0.f, 0.f };
+                for (int k=tx.offset[x]; k<tx.offset[x+1]; k++) {
+                    const float *p = acc.data() + tx.index[k]*bpp;
+                    for (int c=0; c<bpp; c++) sum[c] += tx.weight[k] * p[c];
+                }
+                for (int c=0; c<bpp; c++) out[x*bpp + c] = to_byte(sum[c]);
+            }
+        }
+    });
+}
+
+// Exact 2:1 box reduction of two source rows
+static void halve_rows(const unsigned char *r0, const unsigned char *r1, unsigned char *out, int dw, int bpp) {
+    int x = 0;
+#if defined(__SSE2__)
+    if (bpp == Image::RGBA) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i two = _mm_set1_epi16(2);
+        for (; x+2<=dw; x+=2) { // four source pixels per row -> two output pixels
+            __m128i a = _mm_loadu_si128((const __m128i *)(r0 + x*8));
+            __m128i b = _mm_loadu_si128((const __m128i *)(r1 + x*8));
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+            hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+            __m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+            _mm_storel_epi64((__m128i *)(out + x*4), _mm_packus_epi16(sum, sum));
+        }
+    }
+#endif
+    for (; x<dw; x++) {
+        const unsigned char *a = r0 + 2*x*bpp;
+        const unsigned char *b = r1 + 2*x*bpp;
+        for (int c=0; c<bpp; c++) {
+            out[x*bpp + c] = (unsigned char)((a[c] + a[bpp + c] + b[c] + b[bpp + c] + 2) >> 2);
+        }
+    }
+}
+
+static void halve(const unsigned char *src, int sw, unsigned char *dst, int dw, int dh, int bpp) {
+    const size_t srow = (size_t)sw * bpp;
+    const size_t drow = (size_t)dw * bpp;
+    parallel_for(0, dh, ROWS_PER_TASK, [&](int y0, int y1) {
+        for (int y=y0; y<y1; y++) {
+            halve_rows(src + 2*y*srow, src + (2*y + 1)*srow, dst + y*drow, dw, bpp);
+        }
+    });
+}
+
+static void resample_into(const unsigned char *src, int sw, int sh, unsigned char *dst, int dw, int dh, int bpp, Image::Filter filter) {
+    if (filter == Image::BOX && sw == 2*dw && sh == 2*dh) {
+        halve(src, sw, dst, dw, dh, bpp);
+    } else {
+        resample(src, sw, sh, dst, dw, dh, bpp, filter);
+    }
+}
+
+bool Image::scale(int w, int h, Filter filter) {
+    if (w<=0 || h<=0 || !data) return false;
+    if (filter == NEAREST) return scale_nearest(w, h);
+    if (w == width && h == height) return true;
+    Image scaled(w, h, bytespp, UNINITIALIZED, pool);
+    resample_into(data, width, height, scaled.data, w, h, bytespp, filter);
+    swap(scaled);
+    return true;
+}
@@ -0,0 +1,128 @@
+/*
+ * Tiny Renderer, https://github.com/ssloy/tinyrenderer
+ * Copyright Dmitry V. Sokolov
+ * zlib license
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not
+ *    be misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#pragma once
+
+#ifndef IMAGE_VIEW_H_FB9A7506_CB5C_11F1_9159_02FC00000001
+#define IMAGE_VIEW_H_FB9A7506_CB5C_11F1_9159_02FC00000001
+
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+// Pixel formats for ImageView. Each one names the in-memory type of a pixel,
+// so that passes over a whole image can work on typed rows instead of going
+// through Image::get/set and ImageColor one pixel at a time.
+
+struct Gray8 {
+    typedef uint8_t Pixel;
+    enum { channels = 1 };
+};
+
+struct RGB8 {
+    struct Pixel { uint8_t c[3]; };
+    enum { channels = 3 };
+};
+
+struct RGBA8 {
+    struct Pixel { uint8_t c[4]; };
+    enum { channels = 4 };
+};
+
+struct Float32 {
+    typedef float Pixel;
+    enum { channels = 1 };
+};
+
+// A contiguous run of pixels, typically one row of a view
+template <typename T> struct Span {
+    T *ptr;
+    size_t count;
+
+    Span() : ptr(NULL), count(0) {}
+    Span(T *p, size_t n) : ptr(p), count(n) {}
+
+    T *begin() const { return ptr; }
+    T *end() const { return ptr + count; }
+    size_t size() const { return count; }
+    bool empty() const { return !count; }
+    T & operator[](size_t i) const { assert(i<count); return ptr[i]; }
+};
+
+// Unchecked, typed access to a pixel buffer. It does not own the pixels;
+// the stride is in pixels and the rows are stored top to bottom.
+template <typename Format> struct ImageView {
+    typedef typename Format::Pixel Pixel;
+
+    Pixel *pixels;
+    int width;
+    int height;
+    int stride;
+
+    ImageView() : pixels(NULL), width(0), height(0), stride(0) {}
+    ImageView(Pixel *p, int w, int h) : pixels(p), width(w), height(h), stride(w) {}
+    ImageView(Pixel *p, int w, int h, int s) : pixels(p), width(w), height(h), stride(s) {}
+    ImageView(void *p, int w, int h) : pixels((Pixel *)p), width(w), height(h), stride(w) {}
+
+    bool valid() const { return pixels != NULL; }
+
+    Pixel *row(int y) const { return pixels + (size_t)y*stride; }
+    Span<Pixel> span(int y) const { return Span<Pixel>(row(y), width); }
+    Pixel & operator()(int x, int y) const { return row(y)[x]; }
+
+    // A rectangular window into the same pixels
+    ImageView<Format> sub(int x, int y, int w, int h) const {
+        return ImageView<Format>(row(y) + x, w, h, stride);
+    }
+};
+
+// Span based bulk operations
+
+template <typename T> void fill(Span<T> dst, const T &value) {
+    for (size_t i=0; i<dst.count; i++) dst.ptr[i] = value;
+}
+
+template <typename T> void copy(Span<T> dst, Span<const T> src) {
+    assert(dst.count == src.count);
+    memcpy((void *)dst.ptr, (const void *)src.ptr, src.count*sizeof(T));
+}
+
+template <typename T> void copy(Span<T> dst, Span<T> src) {
+    copy(dst, Span<const T>(src.ptr, src.count));
+}
+
+template <typename T> void reverse(Span<T> s) {
+    std::reverse(s.begin(), s.end());
+}
+
+// Maps every 8 bit channel value through a 256 entry table
+inline void remap_channel(Span<RGBA8::Pixel> s, int channel, const uint8_t *table) {
+    for (size_t i=0; i<s.count; i++) {
+        s.ptr[i].c[channel] = table[s.ptr[i].c[channel]];
+    }
+}
+
+#endif // IMAGE_VIEW_H_FB9A7506_CB5C_11F1_9159_02FC00000001
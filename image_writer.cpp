@@ -0,0 +1,60 @@
+#include <iostream>
+
+#include "image_writer.h"
+
+ImageWriter::ImageWriter(size_t max_pending) :
+    max_pending(max_pending ? max_pending : 1), busy(false), stopping(false), failed(false),
+    worker(&ImageWriter::run, this) {}
+
+ImageWriter::~ImageWriter() {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    not_empty.notify_all();
+    worker.join();
+}
+
+void ImageWriter::submit(Image &frame, const std::string &filename) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return queue.size() < max_pending; });
+    queue.push_back(Job());
+    queue.back().image.swap(frame);
+    queue.back().filename = filename;
+    lock.unlock();
+    not_empty.notify_one();
+}
+
+bool ImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this] { return queue.empty() && !busy; });
+    bool ok = !failed;
+    failed = false;
+    return ok;
+}
+
+void ImageWriter::run() {
+    for (;;) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) return; // stopping, and everything has been written
+            job.image.swap(queue.front().image);
+            job.filename.swap(queue.front().filename);
+            queue.pop_front();
+            busy = true;
+        }
+        not_full.notify_one();
+
+        bool ok = job.image.write_to_file(job.filename.c_str());
+        if (!ok) std::cerr << "unable to write " << job.filename << std::endl;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            busy = false;
+            if (!ok) failed = true;
+        }
+        idle.notify_all();
+    }
+}
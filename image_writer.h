@@ -0,0 +1,76 @@
+/*
+ * Tiny Renderer, https://github.com/ssloy/tinyrenderer
+ * Copyright Dmitry V. Sokolov
+ * zlib license
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not
+ *    be misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#pragma once
+
+#ifndef IMAGE_WRITER_H_FB9A720E_CB5C_11F1_9159_02FC00000001
+#define IMAGE_WRITER_H_FB9A720E_CB5C_11F1_9159_02FC00000001
+
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "image.h"
+
+// Encodes and writes finished frames on a background thread, so that the
+// caller can start rasterizing the next frame while the previous one is
+// being compressed and flushed to disk.
+class ImageWriter {
+public:
+    ImageWriter(size_t max_pending = 2);
+    ~ImageWriter();
+
+    // Takes the pixels of frame (leaving it empty) and queues them to be
+    // written to filename. Blocks while max_pending frames are already queued.
+    void submit(Image &frame, const std::string &filename);
+
+    // Waits until every queued frame has been written. Returns false if any
+    // write failed since the previous call.
+    bool flush();
+
+private:
+    struct Job {
+        Image image;
+        std::string filename;
+    };
+
+    void run();
+
+    std::deque<Job> queue;
+    size_t max_pending;
+    bool busy;
+    bool stopping;
+    bool failed;
+
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+    std::condition_variable idle;
+    std::thread worker;
+};
+
+#endif // IMAGE_WRITER_H_FB9A720E_CB5C_11F1_9159_02FC00000001
@@ -6,9 +6,11 @@
 #include <libgen.h>
 
 #include "image.h"
+#include "image_writer.h"
 #include "model.h"
 #include "geometry.h"
 #include "render.h"
+#include "vertex_cache.h"
 
 #include "inipp.h"
 #include "arghelper.h"
@@ -42,6 +44,17 @@ static Vec3f light3_dir(4,0,2);
 
 static double global_opacity = 1;
 static double drawing_scale = 1;
+static int ssaa = 1;
+static int msaa = 1; // an on/off switch, anything above 1 takes MSAA_SAMPLES samples
+static double texture_density = 0; // texels kept per pixel of on-screen model size, 0 for full textures
+static std::string texture_cache_dir;
+static std::string mesh_cache_dir;
+static bool smooth_normals = false; // smooth normals for models without them
+static bool vertex_tangents = false; // tangents computed on load instead of per pixel
+static bool cluster_culling = false; // skip clusters of faces that are off screen, hidden or turned away, so back faces never show
+static bool optimize_vertex_order = false; // faces and vertices reordered on load for the vertex cache
+static bool compact_vertices = false; // vertices quantized to 14 bytes once the model is placed
+static double lod_triangle_pixels = 0; // smallest average triangle area in pixels before a simpler level is drawn, 0 to always draw the full model
 static double viewport_zoom = 100;
 static double viewport_aspect = 1;
 static double viewport_offset_x = 0;
@@ -49,6 +62,8 @@ static double viewport_offset_y = 0;
 
 static std::string input_filename, output_filename;
 
+static ImagePool framebuffer_pool;
+
 // Matrices
 
 Matrix translationMatrix(Vec3f v) {
@@ -95,19 +110,60 @@ struct Shader : public IShader {
     mat<2,3,float> varying_uv;  // triangle uv coordinates, written by the vertex shader, read by the fragment shader
     mat<4,3,float> varying_tri; // triangle coordinates (clip coordinates), written by VS, read by FS
     mat<3,3,float> varying_nrm; // normal per vertex to be interpolated by FS
+    mat<3,3,float> varying_tan; // tangent per vertex, when the model has them
+    Vec3f varying_sgn;          // which way the bitangent goes for each vertex
     mat<3,3,float> ndc_tri;     // triangle in normalized device coordinates
+    int material;               // material of the triangle
+
+    // The last vertices shaded, as the faces sharing a vertex come close
+    // after each other; oldest first out
+    struct ShadedVertex {
+        unsigned int index;
+        Vec2f uv;
+        Vec3f nrm;
+        Vec3f tan;
+        float sgn;
+        Vec4f gl_Vertex;
+    };
+    ShadedVertex cache[VERTEX_CACHE_SIZE];
+    unsigned int cache_next;
+
+    Shader() : material(0), cache_next(0) {
+        for (unsigned int i=0; i<VERTEX_CACHE_SIZE; i++) cache[i].index = ~0u;
+    }
 
     virtual Vec4f vertex(int iface, int nthvert) {
-        varying_uv.set_col(nthvert,
-            model->uv(iface, nthvert));
-        varying_nrm.set_col(nthvert,
-            proj<3>((Projection * ModelView).invert_transpose() * embed<4>(model->normal(iface, nthvert), 0.f)));
+        material = model->material(iface);
+        const unsigned int index = model->face(iface)[nthvert];
+        const ShadedVertex *v = nullptr;
+        for (unsigned int i=0; i<VERTEX_CACHE_SIZE && !v; i++) {
+            if (cache[i].index == index) v = &cache[i];
+        }
+        if (!v) {
+            ShadedVertex &s = cache[cache_next];
+            cache_next = (cache_next + 1) % VERTEX_CACHE_SIZE;
+            s.index = index;
+            s.uv = model->uv(iface, nthvert);
+            s.nrm = proj<3>((Projection * ModelView).invert_transpose() * embed<4>(model->normal(iface, nthvert), 0.f));
+            if (model->has_tangents()) {
+                Vec4f tangent = model->tangent(iface, nthvert);
+                s.tan = proj<3>(Projection * ModelView * embed<4>(proj<3>(tangent), 0.f));
+                s.sgn = tangent[3];
+            }
+            s.gl_Vertex = Projection * ModelView * embed<4>(model->vert(iface, nthvert));
+            v = &s;
+        }
 
-        Vec4f gl_Vertex = Projection * ModelView * embed<4>(model->vert(iface, nthvert));
-        varying_tri.set_col(nthvert, gl_Vertex);
-        ndc_tri.set_col(nthvert, proj<3>(gl_Vertex/gl_Vertex[3]));
+        varying_uv.set_col(nthvert, v->uv);
+        varying_nrm.set_col(nthvert, v->nrm);
+        if (model->has_tangents()) {
+            varying_tan.set_col(nthvert, v->tan);
+            varying_sgn[nthvert] = v->sgn;
+        }
+        varying_tri.set_col(nthvert, v->gl_Vertex);
+        ndc_tri.set_col(nthvert, proj<3>(v->gl_Vertex/v->gl_Vertex[3]));
 
-        return gl_Vertex;
+        return v->gl_Vertex;
     }
 
     virtual bool fragment(Vec3f bar, ImageColor &color, Vec3f &normal) {
@@ -116,29 +172,37 @@ struct Shader : public IShader {
         Vec3f bn = (varying_nrm * bar).normalize();
         Vec2f uv = varying_uv * bar;
 
-        mat<3,3,float> A;
-        A[0] = ndc_tri.col(1) - ndc_tri.col(0);
-        A[1] = ndc_tri.col(2) - ndc_tri.col(0);
-        A[2] = bn;
-
-        mat<3,3,float> AI = A.invert();
-
-        Vec3f i = AI * Vec3f(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0);
-        Vec3f j = AI * Vec3f(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0);
-
         mat<3,3,float> B;
-        B.set_col(0, i.normalize());
-        B.set_col(1, j.normalize());
+        if (model->has_tangents()) {
+            Vec3f t = varying_tan * bar;
+            t = (t - bn * (bn * t)).normalize();
+            B.set_col(0, t);
+            B.set_col(1, cross(bn, t) * (varying_sgn * bar < 0 ? -1.f : 1.f));
+        } else {
+            // Tangent space from how the uvs change over the triangle
+            mat<3,3,float> A;
+            A[0] = ndc_tri.col(1) - ndc_tri.col(0);
+            A[1] = ndc_tri.col(2) - ndc_tri.col(0);
+            A[2] = bn;
+
+            mat<3,3,float> AI = A.invert();
+
+            Vec3f i = AI * Vec3f(varying_uv[0][1] - varying_uv[0][0], varying_uv[0][2] - varying_uv[0][0], 0);
+            Vec3f j = AI * Vec3f(varying_uv[1][1] - varying_uv[1][0], varying_uv[1][2] - varying_uv[1][0], 0);
+
+            B.set_col(0, i.normalize());
+            B.set_col(1, j.normalize());
+        }
         B.set_col(2, bn);
 
-        Vec3f n = (B*model->normal(uv)).normalize();
+        Vec3f n = (B*model->normal(material, uv)).normalize();
 
         float diff_light1 = std::max(0.f, n * light1_dir);
         float diff_light2 = std::max(0.f, n * light2_dir);
         float diff_light3 = std::max(0.f, n * light3_dir);
 
         float diff = (diff_light1 + diff_light2 + diff_light3) * 0.5;
-        ImageColor color_diff = (model->diffuse(uv) * diff);
+        ImageColor color_diff = (model->diffuse(material, uv) * diff);
 
         color.add(color_diff);
 
@@ -203,6 +267,20 @@ static void readConfig(const std::string filename) {
     //~ std::cout << height;
 
     inipp::extract(ini.sections["CONFIG"]["scale"], drawing_scale);
+    inipp::extract(ini.sections["CONFIG"]["ssaa"], ssaa);
+    inipp::extract(ini.sections["CONFIG"]["msaa"], msaa);
+    if (msaa > 1 && msaa != MSAA_SAMPLES) {
+        std::cerr << "msaa " << msaa << " is not supported, taking " << MSAA_SAMPLES << " samples" << std::endl;
+    }
+    inipp::extract(ini.sections["CONFIG"]["texture_density"], texture_density);
+    inipp::extract(ini.sections["CONFIG"]["texture_cache_dir"], texture_cache_dir);
+    inipp::extract(ini.sections["CONFIG"]["mesh_cache_dir"], mesh_cache_dir);
+    inipp::extract(ini.sections["CONFIG"]["smooth_normals"], smooth_normals);
+    inipp::extract(ini.sections["CONFIG"]["tangents"], vertex_tangents);
+    inipp::extract(ini.sections["CONFIG"]["lod_triangle_pixels"], lod_triangle_pixels);
+    inipp::extract(ini.sections["CONFIG"]["cluster_culling"], cluster_culling);
+    inipp::extract(ini.sections["CONFIG"]["optimize_vertex_order"], optimize_vertex_order);
+    inipp::extract(ini.sections["CONFIG"]["compact_vertices"], compact_vertices);
 
     inipp::extract(ini.sections["CONFIG"]["zoom"], viewport_zoom);
     inipp::extract(ini.sections["CONFIG"]["aspect"], viewport_aspect);
@@ -253,6 +331,120 @@ static int mkpath(const char * dir, mode_t mode = S_IRWXU) {
     return mkdir(dir, mode);
 }
 
+// Outlines
+
+// Blackens the pixels around silhouettes and creases, comparing every pixel
+// with its neighbours d pixels away
+static void draw_outlines(Image &image, float *zbuffer, Vec3f *normals_buffer, int d = 1) {
+    const RGBA8::Pixel black = {{ 0, 0, 0, 255 }};
+    ImageView<RGBA8> pixels = image.view<RGBA8>();
+    const int w = image.get_width();
+    const int h = image.get_height();
+    for (int y = 0; y < h; ++y) {
+        for (int x = 0; x < w; ++x) {
+            float z = zbuffer[w * y + x];
+            Vec3f & n = normals_buffer[w * y + x];
+            if (n[0] || n[1] || n[1]) {
+                if (x - d >= 0) {
+                    if (n*normals_buffer[w * y + (x - d)] < 0.1)
+                        pixels(x, y) = black;
+                    if (fabs(zbuffer[w * y + (x - d)] - z) > 0.15)
+                        pixels(x, y) = black;
+                } else pixels(x, y) = black;
+                if (x + d < w) {
+                    if (n*normals_buffer[w * y + (x + d)] < 0.1)
+                        pixels(x, y) = black;
+                    if (fabs(zbuffer[w * y + (x + d)] - z) > 0.15)
+                        pixels(x, y) = black;
+                } else pixels(x, y) = black;
+                if (y - d >= 0) {
+                    if (n*normals_buffer[w * (y - d) + x] < 0.1)
+                        pixels(x, y) = black;
+                    if (fabs(zbuffer[w * (y - d) + x] - z) > 0.15)
+                        pixels(x, y) = black;
+                } else pixels(x, y) = black;
+                if (y + d < h) {
+                    if (n*normals_buffer[w * (y + d) + x] < 0.1)
+                        pixels(x, y) = black;
+                    if (fabs(zbuffer[w * (y + d) + x] - z) > 0.15)
+                        pixels(x, y) = black;
+                } else pixels(x, y) = black;
+            } else {
+                if (x - d >= 0 && normals_buffer[w * y + (x-d)].norm() > 0.1)
+                    pixels(x, y) = black;
+                if (x + d < w && normals_buffer[w * y + (x+d)].norm() > 0.1)
+                    pixels(x, y) = black;
+                if (y - d >= 0 && normals_buffer[w * (y-d) + x].norm() > 0.1)
+                    pixels(x, y) = black;
+                if (y + d < h && normals_buffer[w * (y+d) + x].norm() > 0.1)
+                    pixels(x, y) = black;
+            }
+        }
+    }
+}
+
+// Average area of the model's triangles on screen, in pixels
+static double average_face_pixels(Model *model) {
+    if (model->nfaces() == 0) return 0;
+    const Matrix transform = Viewport * Projection * ModelView;
+    double area = 0;
+    for (int i = 0; i < model->nfaces(); i++) {
+        Vec2f pts[3];
+        for (int j = 0; j < 3; j++) {
+            Vec4f p = transform * embed<4>(model->vert(i, j));
+            pts[j] = proj<2>(p / p[3]);
+        }
+        area += fabs(cross(embed<3>(pts[1] - pts[0]), embed<3>(pts[2] - pts[0]))[2]) / 2;
+    }
+    return area / model->nfaces();
+}
+
+// Draws the faces of the model's clusters that may show up in a width x
+// height image with draw_face(iface), leaving out every face turned away from
+// the eye so that the image does not depend on how the faces are clustered.
+// Given depth, the depth buffer the faces go to with samples values per pixel,
+// clusters behind what is already drawn are skipped too. Its hierarchical
+// version is brought up to date over the rectangle around the clusters drawn
+// since the last time once they have covered as many pixels as the rectangle
+// has, so that costs no more than the drawing did.
+template <typename DrawFace>
+static void draw_clusters(Model *model, int width, int height, bool reverse_pov, const float *depth, int samples, DrawFace draw_face) {
+    DepthPyramid hierarchical_depth;
+    if (depth) hierarchical_depth.build(depth, width, height, samples);
+    int counts[4] = { 0, 0, 0, 0 };
+    long long drawn = 0;
+    Vec2i dirtymin(width, height), dirtymax(-1, -1);
+    const std::vector<Cluster> &clusters = model->clusters();
+    const bool flip = model->mirrored();
+    for (unsigned int c = 0; c < clusters.size(); c++) {
+        Vec2i bboxmin, bboxmax;
+        ClusterVisibility visibility = cluster_visibility(clusters[c], width, height, reverse_pov,
+            depth ? &hierarchical_depth : nullptr, bboxmin, bboxmax);
+        counts[visibility]++;
+        if (visibility != CLUSTER_VISIBLE) continue;
+        for (unsigned int i = clusters[c].first_face; i < clusters[c].first_face + clusters[c].nfaces; i++) {
+            if (!face_turned_away(model->vert(i, 0), model->vert(i, 1), model->vert(i, 2), flip, reverse_pov)) draw_face(i);
+        }
+        if (depth) {
+            drawn += (long long)(bboxmax.x - bboxmin.x + 1) * (bboxmax.y - bboxmin.y + 1);
+            for (int k = 0; k < 2; k++) {
+                dirtymin[k] = std::min(dirtymin[k], bboxmin[k]);
+                dirtymax[k] = std::max(dirtymax[k], bboxmax[k]);
+            }
+            if (drawn >= (long long)(dirtymax.x - dirtymin.x + 1) * (dirtymax.y - dirtymin.y + 1)) {
+                hierarchical_depth.update(depth, samples, dirtymin.x, dirtymin.y, dirtymax.x, dirtymax.y);
+                drawn = 0;
+                dirtymin = Vec2i(width, height);
+                dirtymax = Vec2i(-1, -1);
+            }
+        }
+    }
+    if (dsr::verbose) {
+        std::cerr << "clusters: " << counts[CLUSTER_VISIBLE] << " drawn, " << counts[CLUSTER_OUTSIDE] << " outside, "
+            << counts[CLUSTER_BACKFACE] << " facing away, " << counts[CLUSTER_OCCLUDED] << " occluded" << std::endl;
+    }
+}
+
 // Main program
 
 int main (int argc, const char * const * argv, const char * const * envp) {
@@ -314,12 +506,18 @@ int main (int argc, const char * const * argv, const char * const * envp) {
     viewport_offset_x = viewport_offset_x * drawing_scale;
     viewport_offset_y = viewport_offset_y * drawing_scale;
 
+    if (!texture_cache_dir.empty()) {
+        mkpath(texture_cache_dir.c_str());
+        TextureCache::shared().set_disk_cache(texture_cache_dir);
+    }
+    if (!mesh_cache_dir.empty()) mkpath(mesh_cache_dir.c_str());
+
     float *zbuffer = new float[width*height];
     for (int i=width*height; i--; zbuffer[i] = -std::numeric_limits<float>::max());
 
     Vec3f *normals_buffer = new Vec3f[width*height];
 
-    Image frame(width, height, Image::RGBA);
+    Image frame(width, height, Image::RGBA, Image::ZEROED, &framebuffer_pool);
     lookat(eye, center, up);
 
     double viewport_aspect_sq = sqrt(fabs(viewport_aspect));
@@ -363,20 +561,90 @@ int main (int argc, const char * const * argv, const char * const * envp) {
     std::cout << mod_matrix;
 
     if (true) {
-        model = new Model(input_filename.c_str());
+        ModelLoadOptions options;
+        if (texture_density > 0) {
+            // A unit of model space spans viewport_zoom pixels, the model fits in about one unit
+            double footprint = viewport_zoom * std::max(viewport_aspect_sq, 1 / viewport_aspect_sq) * std::max(ssaa, 1);
+            options.max_texture_size = std::max(1, (int)ceil(footprint * texture_density));
+        }
+        options.mesh_cache_dir = mesh_cache_dir;
+        options.smooth_normals = smooth_normals;
+        options.tangents = vertex_tangents;
+        options.lods = lod_triangle_pixels > 0;
+        options.clusters = cluster_culling;
+        options.optimize_vertex_order = optimize_vertex_order;
+        options.verbose = dsr::verbose;
+        model = new Model(input_filename.c_str(), options);
         model->modify(mod_matrix);
+        if (model->nlods() > 1) {
+            // The full model while its triangles are big enough, else the
+            // finest level whose triangles are, else the coarsest one
+            for (int level = 0; level < model->nlods(); level++) {
+                model->set_lod(level);
+                if (average_face_pixels(model) >= lod_triangle_pixels) break;
+            }
+            if (dsr::verbose) {
+                std::cerr << "level of detail " << model->lod() << " of " << model->nlods()
+                    << ", " << model->nfaces() << " triangles" << std::endl;
+            }
+        }
         if (invert_normals) model->invert_normals();
+        if (compact_vertices) {
+            model->compact();
+            if (dsr::verbose) {
+                size_t nverts = model->nverts();
+                std::cerr << "compact vertices: " << nverts * (sizeof(Vec3f) * 2 + sizeof(Vec2f)) / 1024 << " KiB > "
+                    << nverts * sizeof(CompactVertex) / 1024 << " KiB" << std::endl;
+            }
+        }
         Shader shader;
-        for (int i=0; i<model->nfaces(); i++) {
-            for (int j=0; j<3; j++) {
-                shader.vertex(i, j);
+        const bool culling = !model->clusters().empty();
+        if (ssaa > 1) {
+            // The faces of the clusters that may show up; there is no depth
+            // to test them against until the tiles are resolved
+            std::vector<int> faces;
+            if (culling) draw_clusters(model, width, height, reverse_pov, nullptr, 1, [&](int i) { faces.push_back(i); });
+            // opacity and outlines are applied to each tile before it is downsampled
+            render_supersampled(culling ? (int)faces.size() : model->nfaces(), shader, ssaa, frame, zbuffer, reverse_pov, normals_buffer,
+                [](Image &tile, float *tile_zbuffer, Vec3f *tile_normals, int scale) {
+                    if (global_opacity < 0.99) tile.modify_opacity(global_opacity);
+                    draw_outlines(tile, tile_zbuffer, tile_normals, scale);
+                }, culling ? faces.data() : nullptr);
+        } else if (msaa > 1) {
+            MultisampleBuffer samples(width, height, frame.get_bytespp());
+            auto draw_face = [&](int i) {
+                for (int j=0; j<3; j++) {
+                    shader.vertex(i, j);
+                }
+                triangle(shader.varying_tri, shader, samples, reverse_pov);
+            };
+            if (culling) {
+                draw_clusters(model, width, height, reverse_pov, samples.depth.data(), MSAA_SAMPLES, draw_face);
+            } else {
+                for (int i=0; i<model->nfaces(); i++) draw_face(i);
+            }
+            samples.resolve(frame, zbuffer, normals_buffer);
+        } else {
+            auto draw_face = [&](int i) {
+                for (int j=0; j<3; j++) {
+                    shader.vertex(i, j);
+                }
+                triangle(shader.varying_tri, shader, frame, zbuffer, reverse_pov, normals_buffer);
+            };
+            if (culling) {
+                draw_clusters(model, width, height, reverse_pov, zbuffer, 1, draw_face);
+            } else {
+                for (int i=0; i<model->nfaces(); i++) draw_face(i);
             }
-            triangle(shader.varying_tri, shader, frame, zbuffer, reverse_pov, normals_buffer);
         }
         delete model;
+        TextureCache::shared().purge(); // nothing else holds on to its textures
     }
 
-    if (global_opacity < 0.99) frame.modify_opacity(global_opacity);
+    if (ssaa <= 1) {
+        if (global_opacity < 0.99) frame.modify_opacity(global_opacity);
+        draw_outlines(frame, zbuffer, normals_buffer);
+    }
 
     std::string output_path = "./";
     size_t output_last_slash = output_filename.find_last_of("/\\");
@@ -385,51 +653,9 @@ int main (int argc, const char * const * argv, const char * const * envp) {
     }
     mkpath(output_path.c_str());
 
-    ImageColor black(0, 0, 0);
-    for (int y = 0; y < frame.get_height(); ++y) {
-        for (int x = 0; x < frame.get_width(); ++x) {
-            float z = zbuffer[width * y + x];
-            Vec3f & n = normals_buffer[width * y + x];
-            if (n[0] || n[1] || n[1]) {
-                if (x > 0) {
-                    if (n*normals_buffer[width * y + (x - 1)] < 0.1)
-                        frame.set(x, y, black);
-                    if (fabs(zbuffer[width * y + (x - 1)] - z) > 0.15)
-                        frame.set(x, y, black);
-                } else frame.set(x, y, black);
-                if (x < frame.get_width() - 1) {
-                    if (n*normals_buffer[width * y + (x + 1)] < 0.1)
-                        frame.set(x, y, black);
-                    if (fabs(zbuffer[width * y + (x + 1)] - z) > 0.15)
-                        frame.set(x, y, black);
-                } else frame.set(x, y, black);
-                if (y > 0) {
-                    if (n*normals_buffer[width * (y - 1) + x] < 0.1)
-                        frame.set(x, y, black);
-                    if (fabs(zbuffer[width * (y - 1) + x] - z) > 0.15)
-                        frame.set(x, y, black);
-                } else frame.set(x, y, black);
-                if (y < frame.get_height() - 1) {
-                    if (n*normals_buffer[width * (y + 1) + x] < 0.1)
-                        frame.set(x, y, black);
-                    if (fabs(zbuffer[width * (y + 1) + x] - z) > 0.15)
-                        frame.set(x, y, black);
-                } else frame.set(x, y, black);
-            } else {
-                if (x > 0 && normals_buffer[width * y + (x-1)].norm() > 0.1)
-                    frame.set(x, y, black);
-                if (x < frame.get_width() - 1 && normals_buffer[width * y + (x+1)].norm() > 0.1)
-                    frame.set(x, y, black);
-                if (y > 0 && normals_buffer[width * (y-1) + x].norm() > 0.1)
-                    frame.set(x, y, black);
-                if (y < frame.get_height() - 1 && normals_buffer[width * (y+1) + x].norm() > 0.1)
-                    frame.set(x, y, black);
-            }
-        }
-    }
-
     frame.flip_vertically(); // to place the origin in the bottom left corner of the image
-    frame.write_to_file(output_filename.c_str());
+    ImageWriter writer;
+    writer.submit(frame, output_filename); // encoded in the background while we carry on
 
     float zbuffer_min = INFINITY;
     float zbuffer_max = -INFINITY;
@@ -456,6 +682,6 @@ int main (int argc, const char * const * argv, const char * const * envp) {
 
     delete [] normals_buffer;
     delete [] zbuffer;
-    return EXIT_SUCCESS;
+    return writer.flush() ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
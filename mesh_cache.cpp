@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "mesh_cache.h"
+
+static const char MESH_FILE_MAGIC[4] = { 'T', 'R', 'M', 'S' };
+static const uint32_t MESH_FILE_VERSION = 3;
+
+// The file is the header followed by positions, normals, uvs, indices,
+// materials, submeshes, lods, material files and the NUL separated strings
+// they refer to. Each lod entry is followed in turn by its index count for
+// every submesh and then by its indices, after all the entries.
+struct MeshFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t nverts;
+    uint32_t nindices;
+    uint32_t nmaterials;
+    uint32_t nsubmeshes;
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t strings_size;
+    uint32_t nlods;
+    uint32_t nmaterial_files;
+    uint32_t reserved;
+};
+
+struct MeshFileMaterial {
+    uint32_t name, map_Ka, map_Kd, map_Ks, map_Ns, map_d, map_bump; // offsets into the strings
+    float Ka[3], Kd[3], Ks[3];
+    float Ns, Ni, d;
+    int32_t illum;
+};
+
+struct MeshFileSubMesh {
+    uint32_t name;
+    uint32_t first_index;
+    uint32_t index_count;
+    uint32_t material;
+};
+
+struct MeshFileLod {
+    uint32_t nindices;
+    float error;
+};
+
+// A file the mesh depends on, as it was when the mesh was written
+struct MeshFileSource {
+    uint32_t path; // offset into the strings
+    uint32_t reserved;
+    uint64_t size;
+    int64_t mtime;
+};
+
+static_assert(sizeof(MeshFileHeader) == 80, "MeshFileHeader must be 80 bytes");
+static_assert(sizeof(MeshFileMaterial) == 80, "MeshFileMaterial must be 80 bytes");
+static_assert(sizeof(MeshFileSubMesh) == 16, "MeshFileSubMesh must be 16 bytes");
+static_assert(sizeof(MeshFileLod) == 8, "MeshFileLod must be 8 bytes");
+static_assert(sizeof(MeshFileSource) == 24, "MeshFileSource must be 24 bytes");
+static_assert(sizeof(Vec3f) == 3 * sizeof(float) && sizeof(Vec2f) == 2 * sizeof(float), "vectors must be packed floats");
+
+void MeshData::compute_bounds() {
+    if (verts.empty()) {
+        bounds_min = bounds_max = Vec3f(0, 0, 0);
+        return;
+    }
+    bounds_min = bounds_max = verts[0];
+    for (size_t i = 1; i < verts.size(); i++) {
+        for (int j = 0; j < 3; j++) {
+            bounds_min[j] = std::min(bounds_min[j], verts[i][j]);
+            bounds_max[j] = std::max(bounds_max[j], verts[i][j]);
+        }
+    }
+}
+
+void MeshData::sort_by_material() {
+    bool sorted = true;
+    for (size_t i = 1; i < submeshes.size(); i++) {
+        if (submeshes[i].material < submeshes[i - 1].material) sorted = false;
+    }
+    if (sorted) return;
+
+    std::stable_sort(submeshes.begin(), submeshes.end(), [](const SubMesh &a, const SubMesh &b) {
+        return a.material < b.material;
+    });
+    std::vector<unsigned int> sorted_indices;
+    sorted_indices.reserve(indices.size());
+    for (size_t i = 0; i < submeshes.size(); i++) {
+        SubMesh &submesh = submeshes[i];
+        unsigned int first = sorted_indices.size();
+        sorted_indices.insert(sorted_indices.end(), indices.begin() + submesh.first_index, indices.begin() + submesh.first_index + submesh.index_count);
+        submesh.first_index = first;
+    }
+    indices.swap(sorted_indices);
+}
+
+static bool source_info(const std::string &source, uint64_t &size, int64_t &mtime) {
+    struct stat sb;
+    if (stat(source.c_str(), &sb)) return false;
+    size = sb.st_size;
+    mtime = (int64_t)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+    return true;
+}
+
+// Like source_info, but a missing file is recorded too, so that the mesh
+// goes stale when it appears
+static void material_file_info(const std::string &path, uint64_t &size, int64_t &mtime) {
+    if (!source_info(path, size, mtime)) {
+        size = 0;
+        mtime = -1;
+    }
+}
+
+std::string mesh_cache_filename(const std::string &dir, const std::string &source, const std::string &variant) {
+    char canonical[PATH_MAX];
+    const char *path = realpath(source.c_str(), canonical) ? canonical : source.c_str();
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (const char *p = path; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    for (size_t i = 0; i < variant.size(); i++) {
+        hash = (hash ^ (unsigned char)variant[i]) * 1099511628211ULL;
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mesh", (unsigned long long)hash);
+    return dir + "/" + name;
+}
+
+// Bounds checked reading of the mapped file
+class MeshFileReader {
+public:
+    MeshFileReader(const unsigned char *data, size_t size) : data(data), size(size), offset(0) {}
+
+    template <typename T> const T *take(size_t count) {
+        if (count > (size - offset) / sizeof(T)) return NULL;
+        const T *p = (const T *)(data + offset);
+        offset += count * sizeof(T);
+        return p;
+    }
+
+    bool at_end() const { return offset == size; }
+
+private:
+    const unsigned char *data;
+    size_t size;
+    size_t offset;
+};
+
+static bool read_string(const char *strings, uint32_t size, uint32_t offset, std::string &str) {
+    if (offset >= size) return false;
+    str = strings + offset; // the table ends with a NUL
+    return true;
+}
+
+bool read_mesh_cache(const std::string &filename, const std::string &source, MeshData &mesh) {
+    uint64_t source_size;
+    int64_t source_mtime;
+    if (!source_info(source, source_size, source_mtime)) return false;
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat sb;
+    void *base = MAP_FAILED;
+    if (!fstat(fd, &sb) && sb.st_size >= (off_t)sizeof(MeshFileHeader)) {
+        base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    MeshFileReader reader((const unsigned char *)base, sb.st_size);
+    const MeshFileHeader *header = reader.take<MeshFileHeader>(1);
+    bool ok = !memcmp(header->magic, MESH_FILE_MAGIC, sizeof(header->magic))
+        && header->version == MESH_FILE_VERSION
+        && header->source_size == source_size
+        && header->source_mtime == source_mtime;
+
+    const Vec3f *verts = NULL, *norms = NULL;
+    const Vec2f *uv = NULL;
+    const uint32_t *indices = NULL;
+    const MeshFileMaterial *materials = NULL;
+    const MeshFileSubMesh *submeshes = NULL;
+    const MeshFileLod *lods = NULL;
+    const MeshFileSource *material_files = NULL;
+    std::vector<const uint32_t *> lod_counts, lod_indices;
+    const char *strings = NULL;
+    if (ok) {
+        verts = reader.take<Vec3f>(header->nverts);
+        norms = reader.take<Vec3f>(header->nverts);
+        uv = reader.take<Vec2f>(header->nverts);
+        indices = reader.take<uint32_t>(header->nindices);
+        materials = reader.take<MeshFileMaterial>(header->nmaterials);
+        submeshes = reader.take<MeshFileSubMesh>(header->nsubmeshes);
+        lods = reader.take<MeshFileLod>(header->nlods);
+        ok = verts && norms && uv && indices && materials && submeshes && lods;
+        for (uint32_t i = 0; ok && i < header->nlods; i++) {
+            lod_counts.push_back(reader.take<uint32_t>(header->nsubmeshes));
+            lod_indices.push_back(reader.take<uint32_t>(lods[i].nindices));
+            ok = lod_counts.back() && lod_indices.back();
+        }
+        material_files = ok ? reader.take<MeshFileSource>(header->nmaterial_files) : NULL;
+        strings = ok && material_files ? reader.take<char>(header->strings_size) : NULL;
+        ok = ok && strings && reader.at_end()
+            && header->strings_size > 0 && strings[header->strings_size - 1] == '\0';
+    }
+    std::vector<std::string> material_paths(ok ? header->nmaterial_files : 0);
+    for (uint32_t i = 0; ok && i < header->nmaterial_files; i++) {
+        uint64_t size;
+        int64_t mtime;
+        ok = read_string(strings, header->strings_size, material_files[i].path, material_paths[i]);
+        if (ok) material_file_info(material_paths[i], size, mtime);
+        ok = ok && material_files[i].size == size && material_files[i].mtime == mtime;
+    }
+    for (uint32_t i = 0; ok && i < header->nindices; i++) {
+        ok = indices[i] < header->nverts;
+    }
+    for (uint32_t i = 0; ok && i < header->nlods; i++) {
+        uint64_t total = 0;
+        for (uint32_t j = 0; j < header->nsubmeshes; j++) total += lod_counts[i][j];
+        ok = total == lods[i].nindices;
+        for (uint32_t j = 0; ok && j < lods[i].nindices; j++) {
+            ok = lod_indices[i][j] < header->nverts;
+        }
+    }
+
+    if (ok) {
+        mesh.verts.assign(verts, verts + header->nverts);
+        mesh.norms.assign(norms, norms + header->nverts);
+        mesh.uv.assign(uv, uv + header->nverts);
+        mesh.indices.assign(indices, indices + header->nindices);
+        mesh.material_files.swap(material_paths);
+        mesh.bounds_min = Vec3f(header->bounds_min[0], header->bounds_min[1], header->bounds_min[2]);
+        mesh.bounds_max = Vec3f(header->bounds_max[0], header->bounds_max[1], header->bounds_max[2]);
+
+        mesh.materials.resize(header->nmaterials);
+        for (uint32_t i = 0; ok && i < header->nmaterials; i++) {
+            const MeshFileMaterial &src = materials[i];
+            MeshMaterial &dst = mesh.materials[i];
+            ok = read_string(strings, header->strings_size, src.name, dst.name)
+                && read_string(strings, header->strings_size, src.map_Ka, dst.map_Ka)
+                && read_string(strings, header->strings_size, src.map_Kd, dst.map_Kd)
+                && read_string(strings, header->strings_size, src.map_Ks, dst.map_Ks)
+                && read_string(strings, header->strings_size, src.map_Ns, dst.map_Ns)
+                && read_string(strings, header->strings_size, src.map_d, dst.map_d)
+                && read_string(strings, header->strings_size, src.map_bump, dst.map_bump);
+            dst.Ka = Vec3f(src.Ka[0], src.Ka[1], src.Ka[2]);
+            dst.Kd = Vec3f(src.Kd[0], src.Kd[1], src.Kd[2]);
+            dst.Ks = Vec3f(src.Ks[0], src.Ks[1], src.Ks[2]);
+            dst.Ns = src.Ns;
+            dst.Ni = src.Ni;
+            dst.d = src.d;
+            dst.illum = src.illum;
+        }
+
+        mesh.submeshes.resize(header->nsubmeshes);
+        for (uint32_t i = 0; ok && i < header->nsubmeshes; i++) {
+            const MeshFileSubMesh &src = submeshes[i];
+            SubMesh &dst = mesh.submeshes[i];
+            ok = read_string(strings, header->strings_size, src.name, dst.name)
+                && src.first_index <= header->nindices
+                && src.index_count <= header->nindices - src.first_index
+                && src.material < header->nmaterials;
+            dst.first_index = src.first_index;
+            dst.index_count = src.index_count;
+            dst.material = src.material;
+        }
+
+        mesh.lods.resize(header->nlods);
+        for (uint32_t i = 0; ok && i < header->nlods; i++) {
+            MeshLod &dst = mesh.lods[i];
+            dst.error = lods[i].error;
+            dst.index_counts.assign(lod_counts[i], lod_counts[i] + header->nsubmeshes);
+            dst.indices.assign(lod_indices[i], lod_indices[i] + lods[i].nindices);
+        }
+    }
+
+    munmap(base, sb.st_size);
+    if (!ok) mesh = MeshData();
+    return ok;
+}
+
+// Strings are stored once each
+class StringTable {
+public:
+    uint32_t add(const std::string &str) {
+        std::vector<std::string>::iterator it = std::find(strings.begin(), strings.end(), str);
+        if (it != strings.end()) return offsets[it - strings.begin()];
+        strings.push_back(str);
+        offsets.push_back((uint32_t)data.size());
+        data.insert(data.end(), str.c_str(), str.c_str() + str.size() + 1);
+        return offsets.back();
+    }
+
+    std::vector<char> data;
+
+private:
+    std::vector<std::string> strings;
+    std::vector<uint32_t> offsets;
+};
+
+bool write_mesh_cache(const std::string &filename, const std::string &source, const MeshData &mesh) {
+    MeshFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+    header.version = MESH_FILE_VERSION;
+    if (!source_info(source, header.source_size, header.source_mtime)) return false;
+    header.nverts = mesh.verts.size();
+    header.nindices = mesh.indices.size();
+    header.nmaterials = mesh.materials.size();
+    header.nsubmeshes = mesh.submeshes.size();
+    header.nlods = mesh.lods.size();
+    header.nmaterial_files = mesh.material_files.size();
+    for (int j = 0; j < 3; j++) {
+        header.bounds_min[j] = mesh.bounds_min[j];
+        header.bounds_max[j] = mesh.bounds_max[j];
+    }
+    if (mesh.norms.size() != mesh.verts.size() || mesh.uv.size() != mesh.verts.size()) return false;
+
+    StringTable strings;
+    strings.add("");
+    std::vector<MeshFileMaterial> materials(mesh.materials.size());
+    for (size_t i = 0; i < mesh.materials.size(); i++) {
+        const MeshMaterial &src = mesh.materials[i];
+        MeshFileMaterial &dst = materials[i];
+        dst.name = strings.add(src.name);
+        dst.map_Ka = strings.add(src.map_Ka);
+        dst.map_Kd = strings.add(src.map_Kd);
+        dst.map_Ks = strings.add(src.map_Ks);
+        dst.map_Ns = strings.add(src.map_Ns);
+        dst.map_d = strings.add(src.map_d);
+        dst.map_bump = strings.add(src.map_bump);
+        for (int j = 0; j < 3; j++) {
+            dst.Ka[j] = src.Ka[j];
+            dst.Kd[j] = src.Kd[j];
+            dst.Ks[j] = src.Ks[j];
+        }
+        dst.Ns = src.Ns;
+        dst.Ni = src.Ni;
+        dst.d = src.d;
+        dst.illum = src.illum;
+    }
+    std::vector<MeshFileSubMesh> submeshes(mesh.submeshes.size());
+    for (size_t i = 0; i < mesh.submeshes.size(); i++) {
+        submeshes[i].name = strings.add(mesh.submeshes[i].name);
+        submeshes[i].first_index = mesh.submeshes[i].first_index;
+        submeshes[i].index_count = mesh.submeshes[i].index_count;
+        submeshes[i].material = mesh.submeshes[i].material;
+    }
+    std::vector<MeshFileSource> material_files(mesh.material_files.size());
+    for (size_t i = 0; i < mesh.material_files.size(); i++) {
+        material_files[i].path = strings.add(mesh.material_files[i]);
+        material_file_info(mesh.material_files[i], material_files[i].size, material_files[i].mtime);
+    }
+    header.strings_size = strings.data.size();
+    std::vector<MeshFileLod> lods(mesh.lods.size());
+    for (size_t i = 0; i < mesh.lods.size(); i++) {
+        if (mesh.lods[i].index_counts.size() != mesh.submeshes.size()) return false;
+        lods[i].nindices = mesh.lods[i].indices.size();
+        lods[i].error = mesh.lods[i].error;
+    }
+
+    // Written under another name first, so that nobody maps half a file
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long)getpid());
+    std::string tmpname = filename + suffix;
+    FILE *fp = fopen(tmpname.c_str(), "wb");
+    if (!fp) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(mesh.verts.data(), sizeof(Vec3f), mesh.verts.size(), fp) == mesh.verts.size()
+        && fwrite(mesh.norms.data(), sizeof(Vec3f), mesh.norms.size(), fp) == mesh.norms.size()
+        && fwrite(mesh.uv.data(), sizeof(Vec2f), mesh.uv.size(), fp) == mesh.uv.size()
+        && fwrite(mesh.indices.data(), sizeof(uint32_t), mesh.indices.size(), fp) == mesh.indices.size()
+        && fwrite(materials.data(), sizeof(MeshFileMaterial), materials.size(), fp) == materials.size()
+        && fwrite(submeshes.data(), sizeof(MeshFileSubMesh), submeshes.size(), fp) == submeshes.size()
+        && fwrite(lods.data(), sizeof(MeshFileLod), lods.size(), fp) == lods.size();
+    for (size_t i = 0; ok && i < mesh.lods.size(); i++) {
+        const MeshLod &lod = mesh.lods[i];
+        ok = fwrite(lod.index_counts.data(), sizeof(uint32_t), lod.index_counts.size(), fp) == lod.index_counts.size()
+            && fwrite(lod.indices.data(), sizeof(uint32_t), lod.indices.size(), fp) == lod.indices.size();
+    }
+    ok = ok && fwrite(material_files.data(), sizeof(MeshFileSource), material_files.size(), fp) == material_files.size()
+        && fwrite(strings.data.data(), 1, strings.data.size(), fp) == strings.data.size();
+    ok = !fclose(fp) && ok;
+    if (ok) ok = !rename(tmpname.c_str(), filename.c_str());
+    if (!ok) unlink(tmpname.c_str());
+    return ok;
+}
@@ -0,0 +1,93 @@
+/*
+ * Tiny Renderer, https://github.com/ssloy/tinyrenderer
+ * Copyright Dmitry V. Sokolov
+ * zlib license
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not
+ *    be misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#pragma once
+
+#ifndef MESH_CACHE_H_FB9A7736_CB5C_11F1_9159_02FC00000001
+#define MESH_CACHE_H_FB9A7736_CB5C_11F1_9159_02FC00000001
+
+#include <string>
+#include <vector>
+
+#include "geometry.h"
+
+struct MeshMaterial {
+    std::string name;
+    Vec3f Ka, Kd, Ks;
+    float Ns, Ni, d;
+    int illum;
+    std::string map_Ka, map_Kd, map_Ks, map_Ns, map_d, map_bump;
+
+    MeshMaterial() : Ns(0), Ni(0), d(0), illum(0) {}
+};
+
+// A range of the index buffer drawn with one material
+struct SubMesh {
+    std::string name;
+    unsigned int first_index;
+    unsigned int index_count;
+    unsigned int material; // into MeshData::materials
+};
+
+// A simplified copy of the index buffer, using the same vertices
+struct MeshLod {
+    float error; // how far its surface may be from the full one, in model units
+    std::vector<unsigned int> indices;
+    std::vector<unsigned int> index_counts; // of each submesh, one after the other
+
+    MeshLod() : error(0) {}
+};
+
+// A triangle mesh with one set of indices for positions, normals and uvs
+struct MeshData {
+    std::vector<Vec3f> verts;
+    std::vector<Vec3f> norms;
+    std::vector<Vec2f> uv;
+    std::vector<unsigned int> indices;
+    std::vector<MeshMaterial> materials;
+    std::vector<SubMesh> submeshes;
+    std::vector<MeshLod> lods; // each coarser than the one before
+    std::vector<std::string> material_files; // the mtllib files it was read with
+    Vec3f bounds_min, bounds_max;
+
+    void compute_bounds();
+    // Reorders the submeshes, and their faces in indices, so that the ones
+    // using the same material are next to each other; before any lods are made
+    void sort_by_material();
+};
+
+// Binary mesh files, made from an OBJ file and only valid as long as the
+// size and modification time of it and of its material files do not change.
+// They are memory mapped and copied out without any parsing.
+
+// Where the mesh for source lives in dir; meshes parsed with different
+// settings from the same source are told apart by variant
+std::string mesh_cache_filename(const std::string &dir, const std::string &source, const std::string &variant = "");
+
+// Fails if the file is missing, damaged, from another version or stale
+bool read_mesh_cache(const std::string &filename, const std::string &source, MeshData &mesh);
+bool write_mesh_cache(const std::string &filename, const std::string &source, const MeshData &mesh);
+
+#endif // MESH_CACHE_H_FB9A7736_CB5C_11F1_9159_02FC00000001
@@ -2,20 +2,92 @@
 #include <fstream>
 #include <sstream>
 #include <cctype>
+#include <algorithm>
+#include <limits>
 
 #include "model.h"
+#include "parallel.h"
+#include "mesh_cache.h"
+#include "simplify.h"
+#include "cluster.h"
+#include "vertex_cache.h"
 
 #include "obj_loader.h"
 
-bool Model::load_obj_model(std::string filename) {
-    std::string path = "./";
-    size_t slash = filename.find_last_of("/\\");
-    if (slash != std::string::npos) {
-        path = filename.substr(0, slash) + "/";
+// A unit vector folded onto the octahedron |x| + |y| + |z| = 1, whose lower
+// half is unfolded over the corners of the upper one, in 16 bits per coordinate
+static void encode_octahedral(Vec3f n, int16_t out[2]) {
+    float l = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    if (!(l > 0)) {
+        out[0] = out[1] = 0;
+        return;
+    }
+    float x = n.x / l, y = n.y / l;
+    if (n.z < 0) {
+        float fx = (1 - std::abs(y)) * (x < 0 ? -1 : 1);
+        float fy = (1 - std::abs(x)) * (y < 0 ? -1 : 1);
+        x = fx;
+        y = fy;
+    }
+    out[0] = (int16_t)floorf(std::max(-1.f, std::min(1.f, x)) * 32767 + .5f);
+    out[1] = (int16_t)floorf(std::max(-1.f, std::min(1.f, y)) * 32767 + .5f);
+}
+
+static Vec3f decode_octahedral(const int16_t in[2]) {
+    float x = in[0] / 32767.f, y = in[1] / 32767.f;
+    float z = 1 - std::abs(x) - std::abs(y);
+    if (z < 0) {
+        float t = -z;
+        x += x < 0 ? t : -t;
+        y += y < 0 ? t : -t;
     }
+    return Vec3f(x, y, z).normalize();
+}
+
+// Gets the textures of a material decoding in the background
+static void request_textures(const std::string &path, const std::string &map_Kd, const std::string &map_bump, int max_size) {
+    if (!map_Kd.empty()) TextureCache::shared().request(path + map_Kd, max_size);
+    if (!map_bump.empty()) TextureCache::shared().request(path + map_bump, max_size);
+}
 
+static MeshMaterial convert_material(const objl::Material &material) {
+    MeshMaterial m;
+    m.name = material.name;
+    m.Ka = Vec3f(material.Ka.X, material.Ka.Y, material.Ka.Z);
+    m.Kd = Vec3f(material.Kd.X, material.Kd.Y, material.Kd.Z);
+    m.Ks = Vec3f(material.Ks.X, material.Ks.Y, material.Ks.Z);
+    m.Ns = material.Ns;
+    m.Ni = material.Ni;
+    m.d = material.d;
+    m.illum = material.illum;
+    m.map_Ka = material.map_Ka;
+    m.map_Kd = material.map_Kd;
+    m.map_Ks = material.map_Ks;
+    m.map_Ns = material.map_Ns;
+    m.map_d = material.map_d;
+    m.map_bump = material.map_bump;
+    return m;
+}
+
+static bool parse_obj_model(const std::string &filename, const std::string &path, const ModelLoadOptions &options, MeshData &mesh) {
     // Initialize Loader
     objl::Loader Loader;
+    // Parse and triangulate the file in chunks on all cores
+    Loader.ParallelFor = [](int count, const std::function<void(int)> &task) {
+        parallel_for(0, count, 1, [&task](int begin, int end) {
+            for (int i = begin; i < end; i++) task(i);
+        });
+    };
+
+    // The meshes are copied straight into the model arrays
+    Loader.KeepLoadedVertices = false;
+    Loader.FlatNormals = !options.smooth_normals;
+
+    // Get the textures decoding while the meshes are built
+    int max_texture_size = options.max_texture_size;
+    Loader.MaterialLoaded = [&path, max_texture_size](const objl::Material &material) {
+        request_textures(path, material.map_Kd, material.map_bump, max_texture_size);
+    };
 
     // Load .obj File
     bool loadout = Loader.LoadFile(filename);
@@ -23,120 +95,470 @@ bool Model::load_obj_model(std::string filename) {
     // Check to see if it loaded
     if (!loadout) return false;
 
-        for (unsigned int i = 0; i < Loader.LoadedMeshes.size(); i++) {
-            // Copy one of the loaded meshes to be our current mesh
-            objl::Mesh curMesh = Loader.LoadedMeshes[i];
+    size_t nverts = 0, nindices = 0;
+    for (unsigned int i = 0; i < Loader.LoadedMeshes.size(); i++) {
+        nverts += Loader.LoadedMeshes[i].Vertices.size();
+        nindices += Loader.LoadedMeshes[i].Indices.size();
+    }
+    mesh.verts.reserve(nverts);
+    mesh.norms.reserve(nverts);
+    mesh.uv.reserve(nverts);
+    mesh.indices.reserve(nindices);
+
+    for (unsigned int i = 0; i < Loader.LoadedMeshes.size(); i++) {
+        objl::Mesh &curMesh = Loader.LoadedMeshes[i];
+
+        // The mesh indices start from 0 for every mesh
+        unsigned int first = mesh.verts.size();
+
+        for (unsigned int j = 0; j < curMesh.Vertices.size(); j++) {
+            const objl::Vertex &vertex = curMesh.Vertices[j];
+            mesh.verts.push_back(Vec3f(vertex.Position.X, vertex.Position.Y, vertex.Position.Z));
+            Vec3f normal(vertex.Normal.X, vertex.Normal.Y, vertex.Normal.Z);
+            if (normal.norm() > 0) normal.normalize(); // missing ones stay zero
+            mesh.norms.push_back(normal);
+            mesh.uv.push_back(Vec2f(vertex.TextureCoordinate.X, vertex.TextureCoordinate.Y));
+        }
 
-            // Print Mesh Name
-            //~ std::cout << "Mesh " << i << ": " << curMesh.MeshName << "\n";
+        SubMesh submesh;
+        submesh.name = curMesh.MeshName;
+        submesh.first_index = mesh.indices.size();
+        submesh.index_count = curMesh.Indices.size();
+        for (unsigned int j = 0; j < curMesh.Indices.size(); j++) {
+            mesh.indices.push_back(first + curMesh.Indices[j]);
+        }
 
-            // Print Vertices
-            //~ std::cout << "Vertices:\n";
+        // Release the loader copy before converting the next mesh
+        std::vector<objl::Vertex>().swap(curMesh.Vertices);
+        std::vector<unsigned int>().swap(curMesh.Indices);
 
-            // Go through each vertex and print its number,
-            //  position, normal, and texture coordinate
-            for (unsigned int j = 0; j < curMesh.Vertices.size(); j++) {
-                //~ std::cout << "V" << j << ": " <<
-                //~     "P(" << curMesh.Vertices[j].Position.X << ", " << curMesh.Vertices[j].Position.Y << ", " << curMesh.Vertices[j].Position.Z << ") " <<
-                //~     "N(" << curMesh.Vertices[j].Normal.X << ", " << curMesh.Vertices[j].Normal.Y << ", " << curMesh.Vertices[j].Normal.Z << ") " <<
-                //~     "TC(" << curMesh.Vertices[j].TextureCoordinate.X << ", " << curMesh.Vertices[j].TextureCoordinate.Y << ")\n";
+        // Meshes sharing a material share its entry
+        submesh.material = 0;
+        while (submesh.material < mesh.materials.size() && mesh.materials[submesh.material].name != curMesh.MeshMaterial.name) {
+            submesh.material++;
+        }
+        if (submesh.material == mesh.materials.size()) {
+            mesh.materials.push_back(convert_material(curMesh.MeshMaterial));
+        }
+        mesh.submeshes.push_back(submesh);
+    }
 
-                Vec3f v(curMesh.Vertices[j].Position.X, curMesh.Vertices[j].Position.Y, curMesh.Vertices[j].Position.Z);
-                m_verts.push_back(v);
-                Vec3f n(curMesh.Vertices[j].Normal.X, curMesh.Vertices[j].Normal.Y, curMesh.Vertices[j].Normal.Z);
-                n = n.normalize();
-                m_norms.push_back(n);
-                Vec2f uv(curMesh.Vertices[j].TextureCoordinate.X, curMesh.Vertices[j].TextureCoordinate.Y);
-                m_uv.push_back(uv);
+    mesh.material_files.swap(Loader.MaterialFiles);
+    mesh.compute_bounds();
+    return true;
+}
 
-            }
+// Simplified copies of the mesh, each with about half the triangles of the
+// one before, for as long as that still gets rid of a good part of them
+static void build_lods(MeshData &mesh) {
+    // The submeshes are simplified one by one, so with more than one material
+    // every open border stays where it is, which keeps the borders between
+    // them closed but also those the model has anyway
+    bool lock_border = mesh.submeshes.size() > 1;
+    const unsigned int *source = mesh.indices.data();
+    size_t source_count = mesh.indices.size();
+    std::vector<unsigned int> source_counts;
+    for (unsigned int i = 0; i < mesh.submeshes.size(); i++) {
+        source_counts.push_back(mesh.submeshes[i].index_count);
+    }
+    float source_error = 0;
+
+    while (source_count >= 3 * 64) {
+        MeshLod lod;
+        lod.error = source_error;
+        lod.indices.resize(source_count);
+        size_t first = 0, count = 0;
+        for (unsigned int i = 0; i < source_counts.size(); i++) {
+            float error = 0;
+            size_t n = simplify(&lod.indices[count], source + first, source_counts[i], mesh.verts.data(),
+                source_counts[i] / 6 * 3, std::numeric_limits<float>::max(), lock_border, &error);
+            lod.index_counts.push_back(n);
+            lod.error = std::max(lod.error, source_error + error);
+            first += source_counts[i];
+            count += n;
+        }
+        lod.indices.resize(count);
+        if (count > source_count * 4 / 5) break;
+
+        mesh.lods.push_back(MeshLod());
+        mesh.lods.back() = std::move(lod);
+        source = mesh.lods.back().indices.data();
+        source_count = count;
+        source_counts = mesh.lods.back().index_counts;
+        source_error = mesh.lods.back().error;
+    }
+}
+
+// Reorders the faces of every submesh, in every level of detail, for a cache
+// of transformed vertices, then numbers the vertices in the order the faces
+// first use them, so they are fetched mostly one after the other
+static void optimize_vertex_order(MeshData &mesh, bool verbose) {
+    float before = verbose ? vertex_cache_acmr(mesh.indices.data(), mesh.indices.size()) : 0;
+    for (unsigned int i = 0; i < mesh.submeshes.size(); i++) {
+        unsigned int *indices = &mesh.indices[mesh.submeshes[i].first_index];
+        optimize_vertex_cache(indices, indices, mesh.submeshes[i].index_count);
+    }
+    for (unsigned int l = 0; l < mesh.lods.size(); l++) {
+        unsigned int first = 0;
+        for (unsigned int i = 0; i < mesh.lods[l].index_counts.size(); i++) {
+            unsigned int *indices = &mesh.lods[l].indices[first];
+            optimize_vertex_cache(indices, indices, mesh.lods[l].index_counts[i]);
+            first += mesh.lods[l].index_counts[i];
+        }
+    }
+    if (verbose) {
+        float after = vertex_cache_acmr(mesh.indices.data(), mesh.indices.size());
+        std::cout << "- vertex cache\t| ACMR " << before << " > " << after << std::endl;
+    }
+
+    // The levels of detail only use vertices of the full mesh
+    std::vector<unsigned int> remap(mesh.verts.size());
+    size_t nverts = optimize_vertex_fetch_remap(remap.data(), mesh.indices.data(), mesh.indices.size(), mesh.verts.size());
+    std::vector<Vec3f> verts(nverts), norms(nverts);
+    std::vector<Vec2f> uv(nverts);
+    for (size_t v = 0; v < mesh.verts.size(); v++) {
+        if (remap[v] == ~0u) continue;
+        verts[remap[v]] = mesh.verts[v];
+        norms[remap[v]] = mesh.norms[v];
+        uv[remap[v]] = mesh.uv[v];
+    }
+    mesh.verts.swap(verts);
+    mesh.norms.swap(norms);
+    mesh.uv.swap(uv);
+    for (size_t i = 0; i < mesh.indices.size(); i++) mesh.indices[i] = remap[mesh.indices[i]];
+    for (unsigned int l = 0; l < mesh.lods.size(); l++) {
+        std::vector<unsigned int> &indices = mesh.lods[l].indices;
+        for (size_t i = 0; i < indices.size(); i++) indices[i] = remap[indices[i]];
+    }
+}
+
+bool Model::load_obj_model(std::string filename) {
+    std::string path = "./";
+    size_t slash = filename.find_last_of("/\\");
+    if (slash != std::string::npos) {
+        path = filename.substr(0, slash) + "/";
+    }
 
-            // Print Indices
-            //~ std::cout << "Indices:\n";
-
-            // Go through every 3rd index and print the
-            //    triangle that these indices represent
-            for (unsigned int j = 0; j < curMesh.Indices.size(); j += 3) {
-                //~ std::cout << "T" << j / 3 << ": " << curMesh.Indices[j] << ", " << curMesh.Indices[j + 1] << ", " << curMesh.Indices[j + 2] << "\n";
-
-                std::vector<Vec3i> f;
-                for (unsigned int k = 0; k < 3; k++) {
-                    Vec3i tmp(
-                        curMesh.Indices[j + k], // Index of the vertex position
-                        curMesh.Indices[j + k], // Index of the texture coordinate (uv)
-                        curMesh.Indices[j + k]  // Index of the vertex normal
-                    );
-                    f.push_back(tmp);
-                }
-                m_faces.push_back(f);
+    MeshData mesh;
+    std::string cachefile;
+    bool cached = false;
+    if (!m_options.mesh_cache_dir.empty()) {
+        std::string variant = std::string(m_options.smooth_normals ? "smooth" : "") + (m_options.lods ? "lods" : "")
+            + (m_options.optimize_vertex_order ? "vcache" : "");
+        cachefile = mesh_cache_filename(m_options.mesh_cache_dir, filename, variant);
+        cached = read_mesh_cache(cachefile, filename, mesh);
+        if (cached) {
+            for (unsigned int i = 0; i < mesh.materials.size(); i++) {
+                request_textures(path, mesh.materials[i].map_Kd, mesh.materials[i].map_bump, m_options.max_texture_size);
             }
+        }
+    }
+    if (!cached) {
+        if (!parse_obj_model(filename, path, m_options, mesh)) return false;
+        mesh.sort_by_material();
+        if (m_options.lods) build_lods(mesh);
+        if (m_options.optimize_vertex_order) optimize_vertex_order(mesh, m_options.verbose);
+        if (!cachefile.empty() && !write_mesh_cache(cachefile, filename, mesh)) {
+            std::cerr << "mesh cache file " << cachefile << " writing failed" << std::endl;
+        }
+    }
 
-            // Print Material
-            std::cout << "Material: " << curMesh.MeshMaterial.name << "\n";
-            std::cout << "Ambient Color: " << curMesh.MeshMaterial.Ka.X << ", " << curMesh.MeshMaterial.Ka.Y << ", " << curMesh.MeshMaterial.Ka.Z << "\n";
-            std::cout << "Diffuse Color: " << curMesh.MeshMaterial.Kd.X << ", " << curMesh.MeshMaterial.Kd.Y << ", " << curMesh.MeshMaterial.Kd.Z << "\n";
-            std::cout << "Specular Color: " << curMesh.MeshMaterial.Ks.X << ", " << curMesh.MeshMaterial.Ks.Y << ", " << curMesh.MeshMaterial.Ks.Z << "\n";
-            std::cout << "Specular Exponent: " << curMesh.MeshMaterial.Ns << "\n";
-            std::cout << "Optical Density: " << curMesh.MeshMaterial.Ni << "\n";
-            std::cout << "Dissolve: " << curMesh.MeshMaterial.d << "\n";
-            std::cout << "Illumination: " << curMesh.MeshMaterial.illum << "\n";
-            std::cout << "Ambient Texture Map: " << curMesh.MeshMaterial.map_Ka << "\n";
-            std::cout << "Diffuse Texture Map: " << curMesh.MeshMaterial.map_Kd << "\n";
-            std::cout << "Specular Color Texture Map: " << curMesh.MeshMaterial.map_Ks << "\n";
-            std::cout << "Specular Highlight Texture Map: " << curMesh.MeshMaterial.map_Ns << "\n";
-            std::cout << "Alpha Texture Map: " << curMesh.MeshMaterial.map_d << "\n";
-            std::cout << "Bump Map: " << curMesh.MeshMaterial.map_bump << "\n";
-
-            load_texture(path, curMesh.MeshMaterial.map_Kd, m_diffusemap, ImageColor(128, 128, 128));
-            load_texture(path, curMesh.MeshMaterial.map_bump, m_normalmap, ImageColor(128, 128, 255));
-            //~ load_texture(filename, "_spec.png", m_specularmap);
-
-            // Leave a space to separate from the next mesh
-            std::cout << "\n";
+    m_verts.swap(mesh.verts);
+    m_norms.swap(mesh.norms);
+    m_uv.swap(mesh.uv);
+    m_indices.swap(mesh.indices);
+    m_indices.resize(m_indices.size() / 3 * 3);
+    m_submeshes.swap(mesh.submeshes);
+
+    m_lods.resize(mesh.lods.size() + 1);
+    for (unsigned int i = 0; i < mesh.lods.size(); i++) {
+        ModelLod &lod = m_lods[i + 1];
+        lod.indices.swap(mesh.lods[i].indices);
+        lod.submeshes = m_submeshes;
+        unsigned int first = 0;
+        for (unsigned int j = 0; j < lod.submeshes.size(); j++) {
+            lod.submeshes[j].first_index = first;
+            lod.submeshes[j].index_count = mesh.lods[i].index_counts[j];
+            first += mesh.lods[i].index_counts[j];
         }
+        lod.error = mesh.lods[i].error;
+    }
+    if (m_options.smooth_normals) generate_normals();
+    if (m_options.tangents) generate_tangents();
+    if (m_options.clusters) split_into_clusters();
+
+    m_materials.resize(std::max<size_t>(mesh.materials.size(), 1));
+    for (unsigned int i = 0; i < mesh.materials.size(); i++) {
+        const MeshMaterial &material = mesh.materials[i];
+        m_materials[i].name = material.name;
+
+        // Print Material
+        std::cout << "Material: " << material.name << "\n";
+        std::cout << "Ambient Color: " << material.Ka[0] << ", " << material.Ka[1] << ", " << material.Ka[2] << "\n";
+        std::cout << "Diffuse Color: " << material.Kd[0] << ", " << material.Kd[1] << ", " << material.Kd[2] << "\n";
+        std::cout << "Specular Color: " << material.Ks[0] << ", " << material.Ks[1] << ", " << material.Ks[2] << "\n";
+        std::cout << "Specular Exponent: " << material.Ns << "\n";
+        std::cout << "Optical Density: " << material.Ni << "\n";
+        std::cout << "Dissolve: " << material.d << "\n";
+        std::cout << "Illumination: " << material.illum << "\n";
+        std::cout << "Ambient Texture Map: " << material.map_Ka << "\n";
+        std::cout << "Diffuse Texture Map: " << material.map_Kd << "\n";
+        std::cout << "Specular Color Texture Map: " << material.map_Ks << "\n";
+        std::cout << "Specular Highlight Texture Map: " << material.map_Ns << "\n";
+        std::cout << "Alpha Texture Map: " << material.map_d << "\n";
+        std::cout << "Bump Map: " << material.map_bump << "\n";
+
+        load_texture(path, material.map_Kd, m_materials[i].diffusemap, ImageColor(128, 128, 128));
+        load_texture(path, material.map_bump, m_materials[i].normalmap, ImageColor(128, 128, 255));
+        //~ load_texture(filename, "_spec.png", m_specularmap);
+
+        // Leave a space to separate from the next material
+        std::cout << "\n";
+    }
+    if (mesh.materials.empty()) {
+        load_texture(path, "", m_materials[0].diffusemap, ImageColor(128, 128, 128));
+        load_texture(path, "", m_materials[0].normalmap, ImageColor(128, 128, 255));
+    }
 
     return true;
+}
 
+// Reorders the faces of every level of detail into clusters, each submesh on its own
+void Model::split_into_clusters() {
+    for (int level = 0; level < nlods(); level++) {
+        bool current = level == m_lod;
+        std::vector<uint32_t> &indices = current ? m_indices : m_lods[level].indices;
+        const std::vector<SubMesh> &submeshes = current ? m_submeshes : m_lods[level].submeshes;
+        std::vector<Cluster> &clusters = current ? m_clusters : m_lods[level].clusters;
+        std::vector<unsigned int> group_sizes;
+        for (unsigned int i = 0; i < submeshes.size(); i++) {
+            group_sizes.push_back(submeshes[i].index_count / 3);
+        }
+        clusters.clear();
+        build_clusters(clusters, indices.data(), group_sizes, m_verts.data(), m_verts.size());
+        if (!m_options.optimize_vertex_order) continue;
+        for (unsigned int i = 0; i < clusters.size(); i++) {
+            uint32_t *face = &indices[clusters[i].first_face * 3];
+            optimize_vertex_cache(face, face, clusters[i].nfaces * 3);
+        }
+    }
+    update_cluster_bounds();
 }
 
-Model::Model(const char *filename) : m_ambient(255 / 8, 249 / 8, 253 / 8) {
+// The bounds follow the vertices, with the faces turned back the right way
+// out after a mirroring modify(), as that is the side that shows
+void Model::update_cluster_bounds() {
+    for (int level = 0; level < (int)m_lods.size(); level++) {
+        bool current = level == m_lod;
+        std::vector<Cluster> &clusters = current ? m_clusters : m_lods[level].clusters;
+        compute_cluster_bounds(clusters, current ? m_indices.data() : m_lods[level].indices.data(), m_verts.data(), m_mirrored);
+    }
+}
+
+// Angle of the corner at a between the edges to b and c
+static float corner_angle(Vec3f a, Vec3f b, Vec3f c) {
+    Vec3f u = b - a, v = c - a;
+    float l = u.norm() * v.norm();
+    if (l <= 0) return 0;
+    return acos(std::max(-1.f, std::min(1.f, u * v / l)));
+}
+
+// Sums what every face adds to its vertices into size values. Each slice of
+// the faces adds into an array of its own, then the arrays are added up a
+// range of values at a time, so no two threads ever write the same value.
+template <typename AddFace> static std::vector<Vec3f> accumulate_faces(int nfaces, size_t size, AddFace add_face) {
+    int nslices = std::max(1, std::min(parallel_threads(), nfaces / 1024));
+    std::vector<std::vector<Vec3f> > slices(nslices);
+    parallel_for(0, nslices, 1, [&](int begin, int end) {
+        for (int s = begin; s < end; s++) {
+            slices[s].resize(size);
+            int first = (int)((long long)nfaces * s / nslices);
+            int last = (int)((long long)nfaces * (s + 1) / nslices);
+            for (int i = first; i < last; i++) add_face(i, slices[s].data());
+        }
+    });
+    parallel_for(0, (int)size, 4096, [&](int begin, int end) {
+        for (int s = 1; s < nslices; s++) {
+            for (int i = begin; i < end; i++) slices[0][i] = slices[0][i] + slices[s][i];
+        }
+    });
+    return std::move(slices[0]);
+}
+
+// Gives the vertices without a normal the sum of the normals of the faces
+// around them, weighted by the face area and the angle of the corner
+void Model::generate_normals() {
+    bool missing = false;
+    for (unsigned int i = 0; i < m_norms.size() && !missing; i++) {
+        missing = m_norms[i] * m_norms[i] == 0;
+    }
+    if (!missing) return;
+
+    std::vector<Vec3f> sums = accumulate_faces(nfaces(), m_verts.size(), [this](int iface, Vec3f *sums) {
+        const uint32_t *idx = &m_indices[iface * 3];
+        Vec3f p[3] = { m_verts[idx[0]], m_verts[idx[1]], m_verts[idx[2]] };
+        Vec3f n = cross(p[1] - p[0], p[2] - p[0]); // twice the area long
+        for (int k = 0; k < 3; k++) {
+            sums[idx[k]] = sums[idx[k]] + n * corner_angle(p[k], p[(k + 1) % 3], p[(k + 2) % 3]);
+        }
+    });
+    parallel_for(0, (int)m_norms.size(), 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            if (m_norms[i] * m_norms[i] == 0 && sums[i] * sums[i] > 0) m_norms[i] = sums[i].normalize();
+        }
+    });
+}
+
+// Tangents follow the u texture direction over the faces around each vertex,
+// with the same weights as the normals, made perpendicular to the normal
+void Model::generate_tangents() {
+    // Tangent then bitangent of each vertex
+    std::vector<Vec3f> sums = accumulate_faces(nfaces(), 2 * m_verts.size(), [this](int iface, Vec3f *sums) {
+        const uint32_t *idx = &m_indices[iface * 3];
+        Vec3f p[3] = { m_verts[idx[0]], m_verts[idx[1]], m_verts[idx[2]] };
+        Vec2f t[3] = { m_uv[idx[0]], m_uv[idx[1]], m_uv[idx[2]] };
+        Vec3f e1 = p[1] - p[0], e2 = p[2] - p[0];
+        Vec2f d1 = t[1] - t[0], d2 = t[2] - t[0];
+        Vec3f tangent = e1 * d2.y - e2 * d1.y;
+        Vec3f bitangent = e2 * d1.x - e1 * d2.x;
+        // Both are missing a division by the uv determinant, whose sign
+        // says which way they go
+        float det = d1.x * d2.y - d2.x * d1.y;
+        float area = cross(e1, e2).norm();
+        float tl = tangent.norm(), bl = bitangent.norm();
+        if (area <= 0 || tl <= 0 || bl <= 0) return;
+        float sign = det < 0 ? -1.f : 1.f;
+        tangent = tangent * (sign * area / tl);
+        bitangent = bitangent * (sign * area / bl);
+        for (int k = 0; k < 3; k++) {
+            float angle = corner_angle(p[k], p[(k + 1) % 3], p[(k + 2) % 3]);
+            sums[2 * idx[k]] = sums[2 * idx[k]] + tangent * angle;
+            sums[2 * idx[k] + 1] = sums[2 * idx[k] + 1] + bitangent * angle;
+        }
+    });
+    m_tangents.resize(m_verts.size());
+    parallel_for(0, (int)m_verts.size(), 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            Vec3f n = m_norms[i];
+            Vec3f t = sums[2 * i] - n * (n * sums[2 * i]);
+            if (t * t > 0) t.normalize();
+            float w = cross(n, t) * sums[2 * i + 1] < 0 ? -1.f : 1.f;
+            m_tangents[i] = embed<4>(t, w);
+        }
+    });
+}
+
+Model::Model(const char *filename, const ModelLoadOptions &options) : m_lod(0), m_mirrored(false), m_ambient(255 / 8, 249 / 8, 253 / 8), m_options(options) {
     load_obj_model(filename);
-    //~ std::cerr << "# v# " << m_verts.size() << " f# "  << m_faces.size() << " vt# " << m_uv.size() << " vn# " << m_norms.size() << std::endl;
+    //~ std::cerr << "# v# " << m_verts.size() << " f# "  << nfaces() << " vt# " << m_uv.size() << " vn# " << m_norms.size() << std::endl;
 }
 
 
 Model::~Model() {}
 
 int Model::nverts() {
-    return (int)m_verts.size();
+    return (int)(m_compact.empty() ? m_verts.size() : m_compact.size());
 }
 
 int Model::nfaces() {
-    return (int)m_faces.size();
+    return (int)(m_indices.size() / 3);
+}
+
+int Model::nlods() {
+    return std::max((int)m_lods.size(), 1);
+}
+
+int Model::lod() {
+    return m_lod;
+}
+
+float Model::lod_error(int level) {
+    return level < (int)m_lods.size() ? m_lods[level].error : 0;
 }
 
-std::vector<int> Model::face(int idx) {
-    std::vector<int> face;
-    for (int i=0; i<(int)m_faces[idx].size(); i++) face.push_back(m_faces[idx][i][0]);
-    return face;
+void Model::set_lod(int level) {
+    if (level == m_lod || level < 0 || level >= (int)m_lods.size()) return;
+    m_lods[m_lod].indices.swap(m_indices);
+    m_lods[m_lod].submeshes.swap(m_submeshes);
+    m_lods[level].indices.swap(m_indices);
+    m_lods[level].submeshes.swap(m_submeshes);
+    m_lods[m_lod].clusters.swap(m_clusters);
+    m_lods[level].clusters.swap(m_clusters);
+    m_lod = level;
+}
+
+Span<const uint32_t> Model::face(int idx) const {
+    return Span<const uint32_t>(&m_indices[idx * 3], 3);
+}
+
+Span<const uint32_t> Model::indices() const {
+    return Span<const uint32_t>(m_indices.data(), m_indices.size());
+}
+
+Span<const Vec3f> Model::verts() const {
+    return Span<const Vec3f>(m_verts.data(), m_verts.size());
+}
+
+Span<const Vec3f> Model::norms() const {
+    return Span<const Vec3f>(m_norms.data(), m_norms.size());
+}
+
+Span<const Vec2f> Model::uvs() const {
+    return Span<const Vec2f>(m_uv.data(), m_uv.size());
+}
+
+const std::vector<SubMesh> &Model::submeshes() const {
+    return m_submeshes;
+}
+
+const std::vector<Cluster> &Model::clusters() const {
+    return m_clusters;
+}
+
+bool Model::mirrored() const {
+    return m_mirrored;
+}
+
+int Model::nmaterials() {
+    return (int)m_materials.size();
+}
+
+int Model::material(int iface) {
+    // Last submesh starting at or before the face
+    unsigned int index = iface * 3;
+    int lo = 0, hi = (int)m_submeshes.size();
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (m_submeshes[mid].first_index <= index) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return 0;
+    return (int)m_submeshes[lo - 1].material;
 }
 
 Vec3f Model::vert(int i) {
-    return m_verts[i];
+    if (m_compact.empty()) return m_verts[i];
+    const uint16_t *q = m_compact[i].position;
+    return Vec3f(m_position_min.x + m_position_step.x * q[0], m_position_min.y + m_position_step.y * q[1], m_position_min.z + m_position_step.z * q[2]);
 }
 
 Vec3f Model::vert(int iface, int nthvert) {
-    return m_verts[m_faces[iface][nthvert][0]];
+    return vert(m_indices[iface * 3 + nthvert]);
+}
+
+static Texture solid_texture(const ImageColor color) {
+    std::shared_ptr<Image> img = std::make_shared<Image>();
+    img->set_to_color(color);
+    return img;
 }
 
-void Model::load_texture(std::string path, std::string texfile, Image &img, const ImageColor color) {
+void Model::load_texture(std::string path, std::string texfile, Texture &img, const ImageColor color) {
     if (!texfile.length()) {
-        img.set_to_color(color);
+        img = solid_texture(color);
     } else {
-        bool read_from_file = img.read_from_file((path + texfile).c_str());
-        std::cerr << "texture file " << texfile << " loading " << (read_from_file ? "ok" : "failed") << std::endl;
-        if (!read_from_file) img.set_to_color(color);
-        img.flip_vertically();
+        img = TextureCache::shared().get(path + texfile, m_options.max_texture_size);
+        std::cerr << "texture file " << texfile << " loading " << (img ? "ok" : "failed") << std::endl;
+        if (!img) img = solid_texture(color);
     }
 }
 
@@ -144,18 +566,20 @@ ImageColor Model::ambient() {
     return m_ambient;
 }
 
-ImageColor Model::diffuse(Vec2f uvf) {
+ImageColor Model::diffuse(int material, Vec2f uvf) {
+    const Image &diffusemap = *m_materials[material].diffusemap;
     float u = uvf[0] - floor(uvf[0]);
     float v = uvf[1] - floor(uvf[1]);
-    Vec2i uv(u * m_diffusemap.get_width(), v * m_diffusemap.get_height());
-    return m_diffusemap.get(uv[0], uv[1]);
+    Vec2i uv(u * diffusemap.get_width(), v * diffusemap.get_height());
+    return diffusemap.get(uv[0], uv[1]);
 }
 
-Vec3f Model::normal(Vec2f uvf) {
+Vec3f Model::normal(int material, Vec2f uvf) {
+    const Image &normalmap = *m_materials[material].normalmap;
     float u = uvf[0] - floor(uvf[0]);
     float v = uvf[1] - floor(uvf[1]);
-    Vec2i uv(u * m_normalmap.get_width(), v * m_normalmap.get_height());
-    ImageColor c = m_normalmap.get(u, v);
+    Vec2i uv(u * normalmap.get_width(), v * normalmap.get_height());
+    ImageColor c = normalmap.get(u, v);
     Vec3f res;
     for (int i=0; i<3; i++) {
         res[i] = (float)c[i]/255.f*2.f - 1.f;
@@ -163,8 +587,18 @@ Vec3f Model::normal(Vec2f uvf) {
     return res;
 }
 
+bool Model::has_tangents() {
+    return !m_tangents.empty();
+}
+
+Vec4f Model::tangent(int iface, int nthvert) {
+    return m_tangents[m_indices[iface * 3 + nthvert]];
+}
+
 Vec2f Model::uv(int iface, int nthvert) {
-    return m_uv[m_faces[iface][nthvert][1]];
+    if (m_compact.empty()) return m_uv[m_indices[iface * 3 + nthvert]];
+    const uint16_t *q = m_compact[m_indices[iface * 3 + nthvert]].uv;
+    return Vec2f(m_uv_min.x + m_uv_step.x * q[0], m_uv_min.y + m_uv_step.y * q[1]);
 }
 
 //~ float Model::specular(Vec2f uvf) {
@@ -173,11 +607,13 @@ Vec2f Model::uv(int iface, int nthvert) {
 //~ }
 
 Vec3f Model::normal(int iface, int nthvert) {
-    int idx = m_faces[iface][nthvert][2];
-    return m_norms[idx].normalize();
+    if (m_compact.empty()) return m_norms[m_indices[iface * 3 + nthvert]].normalize();
+    return decode_octahedral(m_compact[m_indices[iface * 3 + nthvert]].normal);
 }
 
 void Model::modify(const Matrix & m) {
+	bool compacted = !m_compact.empty();
+	if (compacted) expand();
 	for(auto & v: m_verts) {
 		v = proj<3>(m * embed<4>(v));
 	}
@@ -185,12 +621,90 @@ void Model::modify(const Matrix & m) {
 	for(auto & n: m_norms) {
 		n = proj<3>(mn * embed<4>(n));
 	}
+	// A mirroring transform turns the bitangents around
+	float flip = m.get_minor(3, 3).det() < 0 ? -1.f : 1.f;
+	for(auto & t: m_tangents) {
+		Vec3f d = proj<3>(m * embed<4>(proj<3>(t), 0.f));
+		t = embed<4>(d.normalize(), t[3] * flip);
+	}
+	if (flip < 0) m_mirrored = !m_mirrored;
+	update_cluster_bounds();
+	if (compacted) compact();
 }
 
 void Model::invert_normals() {
+	bool compacted = !m_compact.empty();
+	if (compacted) expand();
 	for(auto & n: m_norms) {
 		n[0] = -n[0];
 		n[1] = -n[1];
 		n[2] = -n[2];
 	}
+	for(auto & t: m_tangents) {
+		t[3] = -t[3];
+	}
+	if (compacted) compact();
+}
+
+// Steps of 16 bits between lo and hi, none when they are the same
+static float quantization_step(float lo, float hi) {
+    return hi > lo ? (hi - lo) / 65535 : 0;
+}
+
+static uint16_t quantize(float value, float lo, float step) {
+    if (!(step > 0)) return 0;
+    return (uint16_t)std::max(0.f, std::min(65535.f, floorf((value - lo) / step + .5f)));
+}
+
+void Model::compact() {
+    if (!m_compact.empty() || m_verts.empty()) return;
+    const size_t nverts = m_verts.size();
+
+    Vec3f pmin = m_verts[0], pmax = m_verts[0];
+    Vec2f tmin = m_uv[0], tmax = m_uv[0];
+    for (size_t v = 1; v < nverts; v++) {
+        for (int k = 0; k < 3; k++) {
+            pmin[k] = std::min(pmin[k], m_verts[v][k]);
+            pmax[k] = std::max(pmax[k], m_verts[v][k]);
+        }
+        for (int k = 0; k < 2; k++) {
+            tmin[k] = std::min(tmin[k], m_uv[v][k]);
+            tmax[k] = std::max(tmax[k], m_uv[v][k]);
+        }
+    }
+    m_position_min = pmin;
+    m_uv_min = tmin;
+    for (int k = 0; k < 3; k++) m_position_step[k] = quantization_step(pmin[k], pmax[k]);
+    for (int k = 0; k < 2; k++) m_uv_step[k] = quantization_step(tmin[k], tmax[k]);
+
+    m_compact.resize(nverts);
+    for (size_t v = 0; v < nverts; v++) {
+        CompactVertex &c = m_compact[v];
+        for (int k = 0; k < 3; k++) c.position[k] = quantize(m_verts[v][k], pmin[k], m_position_step[k]);
+        encode_octahedral(m_norms[v], c.normal);
+        for (int k = 0; k < 2; k++) c.uv[k] = quantize(m_uv[v][k], tmin[k], m_uv_step[k]);
+    }
+
+    // The clusters have to hold the vertices where they end up
+    for (size_t v = 0; v < nverts; v++) m_verts[v] = vert(v);
+    update_cluster_bounds();
+
+    std::vector<Vec3f>().swap(m_verts);
+    std::vector<Vec3f>().swap(m_norms);
+    std::vector<Vec2f>().swap(m_uv);
+}
+
+// Back to floats, for the changes that go through every vertex
+void Model::expand() {
+    const size_t nverts = m_compact.size();
+    m_verts.resize(nverts);
+    m_norms.resize(nverts);
+    m_uv.resize(nverts);
+    for (size_t v = 0; v < nverts; v++) {
+        const CompactVertex &c = m_compact[v];
+        m_verts[v] = vert(v);
+        m_norms[v] = decode_octahedral(c.normal);
+        m_uv[v] = Vec2f(m_uv_min.x + m_uv_step.x * c.uv[0], m_uv_min.y + m_uv_step.y * c.uv[1]);
+    }
+    std::vector<CompactVertex>().swap(m_compact);
 }
@@ -27,42 +27,139 @@
 #ifndef MODEL_H_F3EC37E2_8881_11EA_90FB_10FEED04CD1C
 #define MODEL_H_F3EC37E2_8881_11EA_90FB_10FEED04CD1C
 
+#include <stdint.h>
+
 #include <vector>
 #include <string>
 
 #include "geometry.h"
 #include "image.h"
+#include "texture_cache.h"
+#include "mesh_cache.h"
+#include "cluster.h"
+
+struct ModelLoadOptions {
+    // Textures larger than this many texels on their longest side are
+    // reduced on load; 0 keeps them at full resolution
+    int max_texture_size;
+    // Where binary copies of parsed models are kept; empty to always parse
+    std::string mesh_cache_dir;
+    // Vertices the file gives no normal get a smooth one from the faces
+    // around them, instead of each face getting its own flat vertices
+    bool smooth_normals;
+    // Per vertex tangents for normal mapping
+    bool tangents;
+    // Simplified versions of the model to draw when its triangles are small
+    bool lods;
+    // Faces grouped in clusters that can be culled as a whole
+    bool clusters;
+    // Faces ordered to reuse recently transformed vertices, and vertices
+    // ordered as the faces use them
+    bool optimize_vertex_order;
+    // Statistics about the work done on load go to std::cout
+    bool verbose;
+
+    ModelLoadOptions() : max_texture_size(0), smooth_normals(false), tangents(false), lods(false), clusters(false),
+        optimize_vertex_order(false), verbose(false) {}
+};
+
+// Textures of a material, shared by all the faces that use it
+struct ModelMaterial {
+    std::string name;
+    Texture diffusemap;
+    Texture normalmap;
+};
+
+// A simplified version of the model, sharing its vertices
+struct ModelLod {
+    std::vector<uint32_t> indices;
+    std::vector<SubMesh> submeshes;
+    std::vector<Cluster> clusters;
+    float error; // how far its surface may be from the full one, in model units
+
+    ModelLod() : error(0) {}
+};
+
+// A vertex in 14 bytes instead of 32: 16 bits per axis for the position
+// across the bounds of the model, 16 bits per octahedral coordinate for the
+// normal and 16 bits per coordinate for the uv across the range of the uvs
+struct CompactVertex {
+    uint16_t position[3];
+    int16_t normal[2];
+    uint16_t uv[2];
+};
 
 class Model {
 private:
+    // A vertex is the same element of m_verts, m_norms and m_uv, or of
+    // m_compact once compact() has replaced them
     std::vector<Vec3f> m_verts;
-    std::vector<std::vector<Vec3i> > m_faces; // attention, this Vec3i means vertex/uv/normal
     std::vector<Vec3f> m_norms;
     std::vector<Vec2f> m_uv;
-    Image m_diffusemap;
-    Image m_normalmap;
+    std::vector<CompactVertex> m_compact;
+    Vec3f m_position_min, m_position_step; // position = min + step * quantized
+    Vec2f m_uv_min, m_uv_step;
+    std::vector<uint32_t> m_indices; // three vertices per triangle
+    std::vector<Vec4f> m_tangents;   // empty, or w is the sign of the bitangent
+    // Submeshes cover m_indices in order, sorted by material so the faces
+    // of a material are drawn one after the other
+    std::vector<SubMesh> m_submeshes;
+    std::vector<ModelMaterial> m_materials;
+    std::vector<Cluster> m_clusters;
+    // Every level of detail, from the full model on; the indices, submeshes
+    // and clusters of the one in use are in m_indices, m_submeshes and
+    // m_clusters instead
+    std::vector<ModelLod> m_lods;
+    int m_lod;
+    bool m_mirrored; // by modify(), which turns the faces inside out
     //~ Image m_specularmap;
     ImageColor m_ambient;
+    ModelLoadOptions m_options;
 
-    void load_texture(std::string path, std::string texfile, Image &img, const ImageColor color);
+    void load_texture(std::string path, std::string texfile, Texture &img, const ImageColor color);
     bool load_obj_model(std::string filename);
+    void generate_normals();
+    void generate_tangents();
+    void split_into_clusters();
+    void update_cluster_bounds();
+    void expand();
 
 public:
-    Model(const char *filename);
+    Model(const char *filename, const ModelLoadOptions &options = ModelLoadOptions());
     ~Model();
     int nverts();
     int nfaces();
+    int nlods();
+    int lod();
+    float lod_error(int level);
+    void set_lod(int level);
     Vec3f normal(int iface, int nthvert);
-    Vec3f normal(Vec2f uv);
+    Vec3f normal(int material, Vec2f uv);
     Vec3f vert(int i);
     Vec3f vert(int iface, int nthvert);
     Vec2f uv(int iface, int nthvert);
+    bool has_tangents();
+    Vec4f tangent(int iface, int nthvert);
     ImageColor ambient();
-    ImageColor diffuse(Vec2f uv);
+    ImageColor diffuse(int material, Vec2f uv);
+    int nmaterials();
+    int material(int iface);
     //~ float specular(Vec2f uv);
-    std::vector<int> face(int idx);
+    Span<const uint32_t> face(int idx) const;
+    Span<const uint32_t> indices() const;
+    // Empty once compact()ed
+    Span<const Vec3f> verts() const;
+    Span<const Vec3f> norms() const;
+    Span<const Vec2f> uvs() const;
+    const std::vector<SubMesh> &submeshes() const;
+    const std::vector<Cluster> &clusters() const;
+    // Whether modify() has turned the faces inside out, so that their winding
+    // goes the other way around their normal
+    bool mirrored() const;
     void modify(const Matrix & m);
     void invert_normals();
+    // Quantizes the vertices to CompactVertex, decoded again as they are read
+    void compact();
 };
 
 #endif // MODEL_H_F3EC37E2_8881_11EA_90FB_10FEED04CD1C
@@ -41,6 +41,32 @@
 // Math.h - STD math Library
 #include <math.h>
 
+// Functional - STD callbacks
+#include <functional>
+
+// Unordered Map - STD Hash Table
+#include <unordered_map>
+#include <unordered_set>
+
+// POSIX - mapping the file into memory
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Fast string to double conversion, see str2dbl.c
+double str2dbl_end(const char *s, const char **end);
+
+#ifdef __cplusplus
+}
+#endif
+
 // Print progress to console while loading (large models)
 #define OBJL_CONSOLE_OUTPUT
 
@@ -360,6 +386,39 @@ namespace objl
                 return false;
         }
 
+        // Check to see if a polygon is strictly convex, all its corners
+        //    turning the same way around its Newell normal
+        //    and its fan from the first vertex never folding back
+        bool IsConvexPolygon(const Vertex *verts, size_t count)
+        {
+            Vector3 n;
+            for (size_t i = 0; i < count; i++)
+            {
+                const Vector3 &a = verts[i].Position;
+                const Vector3 &b = verts[(i + 1) % count].Position;
+                n.X += (a.Y - b.Y) * (a.Z + b.Z);
+                n.Y += (a.Z - b.Z) * (a.X + b.X);
+                n.Z += (a.X - b.X) * (a.Y + b.Y);
+            }
+
+            for (size_t i = 0; i < count; i++)
+            {
+                const Vector3 &prev = verts[i].Position;
+                const Vector3 &cur = verts[(i + 1) % count].Position;
+                const Vector3 &next = verts[(i + 2) % count].Position;
+                if (math::DotV3(math::CrossV3(cur - prev, next - cur), n) <= 0)
+                    return false;
+            }
+
+            // A star has every corner turning the same way too
+            for (size_t i = 1; i + 1 < count; i++)
+            {
+                if (math::DotV3(GenTriNormal(verts[0].Position, verts[i].Position, verts[i + 1].Position), n) <= 0)
+                    return false;
+            }
+            return true;
+        }
+
         // Split a String into a string array at a given token
         inline void split(const std::string &in,
             std::vector<std::string> &out,
@@ -449,6 +508,195 @@ namespace objl
         }
     }
 
+    // Namespace: Text
+    //
+    // Description: Tokenizing of a NUL terminated text buffer in
+    //    place, without copying or allocating anything
+    namespace text
+    {
+        inline bool IsBlank(char c)
+        {
+            return c == ' ' || c == '\t';
+        }
+
+        inline bool IsLineEnd(char c)
+        {
+            return c == '\n' || c == '\r' || c == '\0';
+        }
+
+        // Whether c ends a keyword
+        inline bool IsSeparator(char c)
+        {
+            return IsBlank(c) || IsLineEnd(c);
+        }
+
+        inline const char *SkipBlanks(const char *p)
+        {
+            while (IsBlank(*p))
+                p++;
+            return p;
+        }
+
+        inline const char *SkipToken(const char *p)
+        {
+            while (!IsSeparator(*p))
+                p++;
+            return p;
+        }
+
+        // Start of the line after the one p is in
+        inline const char *NextLine(const char *p, const char *end)
+        {
+            const char *nl = (const char *)memchr(p, '\n', end - p);
+            return nl ? nl + 1 : end;
+        }
+
+        // Whether p starts with the given keyword as a whole token
+        inline bool IsKeyword(const char *p, const char *keyword)
+        {
+            size_t len = strlen(keyword);
+            return !strncmp(p, keyword, len) && IsSeparator(p[len]);
+        }
+
+        // Everything on the line after the first token, without surrounding blanks
+        inline std::string Tail(const char *p)
+        {
+            const char *start = SkipBlanks(SkipToken(p));
+            const char *end = start;
+            while (*end != '\n' && *end != '\0')
+                end++;
+            while (end > start && (IsBlank(end[-1]) || end[-1] == '\r'))
+                end--;
+            return std::string(start, end);
+        }
+
+        // Reads the next number on the line into f, leaving it untouched if there is none
+        inline bool ParseFloat(const char *&p, float &f)
+        {
+            p = SkipBlanks(p);
+            if (IsLineEnd(*p))
+                return false;
+            const char *end;
+            double d = str2dbl_end(p, &end);
+            if (end == p)
+                return false;
+            f = (float)d;
+            p = SkipToken(end);
+            return true;
+        }
+
+        // Reads a signed integer, stopping at the first character that is not a digit
+        inline bool ParseIndex(const char *&p, int &i)
+        {
+            bool negative = *p == '-';
+            if (*p == '-' || *p == '+')
+                p++;
+            if (*p < '0' || *p > '9')
+                return false;
+            int n = 0;
+            while (*p >= '0' && *p <= '9')
+                n = n * 10 + (*p++ - '0');
+            i = negative ? -n : n;
+            return true;
+        }
+    }
+
+    // Class: MappedFile
+    //
+    // Description: The whole contents of a file, mapped into memory
+    //    when possible, and always followed by a NUL so that
+    //    parsing can never run past the end
+    class MappedFile
+    {
+    public:
+        MappedFile() : data(NULL), size(0), mapped(false) {}
+        ~MappedFile()
+        {
+            Close();
+        }
+
+        bool Open(const std::string &path)
+        {
+            Close();
+
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+
+            struct stat sb;
+            if (fstat(fd, &sb))
+            {
+                close(fd);
+                return false;
+            }
+            size = sb.st_size;
+
+            // The rest of the last page of a mapping reads as zeroes, so a file
+            // that does not end on a page boundary already comes NUL terminated
+            long page = sysconf(_SC_PAGESIZE);
+            if (size > 0 && size % page != 0)
+            {
+                void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED)
+                {
+                    madvise(addr, size, MADV_SEQUENTIAL);
+                    data = (const char *)addr;
+                    mapped = true;
+                    close(fd);
+                    return true;
+                }
+            }
+
+            copy.resize(size + 1);
+            size_t done = 0;
+            while (done < size)
+            {
+                ssize_t n = read(fd, &copy[done], size - done);
+                if (n <= 0)
+                    break;
+                done += n;
+            }
+            close(fd);
+            if (done != size)
+            {
+                Close();
+                return false;
+            }
+            copy[size] = '\0';
+            data = &copy[0];
+            return true;
+        }
+
+        void Close()
+        {
+            if (mapped)
+                munmap((void *)data, size);
+            std::vector<char>().swap(copy);
+            data = NULL;
+            size = 0;
+            mapped = false;
+        }
+
+        const char *Data() const
+        {
+            return data;
+        }
+
+        size_t Size() const
+        {
+            return size;
+        }
+
+    private:
+        MappedFile(const MappedFile &);
+        MappedFile & operator =(const MappedFile &);
+
+        const char *data;
+        size_t size;
+        bool mapped;
+        std::vector<char> copy;
+    };
+
     // Class: Loader
     //
     // Description: The OBJ Model Loader
@@ -456,7 +704,7 @@ namespace objl
     {
     public:
         // Default Constructor
-        Loader()
+        Loader() : KeepLoadedVertices(true), FlatNormals(true), ChunkBytes(1 << 20)
         {
 
         }
@@ -471,26 +719,93 @@ namespace objl
         //
         // If the file is unable to be found
         // or unable to be loaded return false
+        //
+        // The file is cut into chunks of about ChunkBytes at line
+        // boundaries. The chunks are parsed and turned into vertices
+        // through ParallelFor when it is set, then stitched together
+        // in file order.
         bool LoadFile(std::string Path)
         {
             // If the file is not an .obj file return false
-            if (Path.substr(Path.size() - 4, 4) != ".obj")
+            if (Path.size() < 4 || Path.substr(Path.size() - 4, 4) != ".obj")
                 return false;
 
+            MappedFile file;
 
-            std::ifstream file(Path);
-
-            if (!file.is_open())
+            if (!file.Open(Path))
                 return false;
 
             LoadedMeshes.clear();
             LoadedVertices.clear();
             LoadedIndices.clear();
 
+            // Line aligned chunks
+            std::vector<Chunk> chunks(std::max<size_t>(1, file.Size() / std::max<size_t>(1, ChunkBytes)));
+            const char *end = file.Data() + file.Size();
+            const char *begin = file.Data();
+            for (size_t i = 0; i < chunks.size(); i++)
+            {
+                chunks[i].Begin = begin;
+                if (i + 1 < chunks.size())
+                    begin = text::NextLine(std::max(begin, file.Data() + file.Size() / chunks.size() * (i + 1) - 1), end);
+                else
+                    begin = end;
+                chunks[i].End = begin;
+            }
+
+            // Read the material libraries before anything else, so the
+            // caller can start on the textures while we parse the file
+            for (const char *line : FindMaterialLibraries(file.Data(), end))
+            {
+                // Generate a path to the material file
+                size_t slash = Path.find_last_of('/');
+                std::string pathtomat = slash != std::string::npos ? Path.substr(0, slash + 1) : "";
+
+                pathtomat += text::Tail(line);
+
+                #ifdef OBJL_CONSOLE_OUTPUT
+                std::cout << "- find materials in: " << pathtomat << std::endl;
+                #endif
+
+                // Load Materials
+                size_t firstnew = LoadedMaterials.size();
+                MaterialFiles.push_back(pathtomat);
+                LoadMaterials(pathtomat);
+
+                if (MaterialLoaded)
+                {
+                    for (size_t i = firstnew; i < LoadedMaterials.size(); i++)
+                        MaterialLoaded(LoadedMaterials[i]);
+                }
+            }
+
+            RunChunks(chunks.size(), [&chunks](int i) { ParseChunk(chunks[i]); });
+
+            // Prefix sums give every chunk the global position of its elements
             std::vector<Vector3> Positions;
             std::vector<Vector2> TCoords;
             std::vector<Vector3> Normals;
+            for (size_t i = 0; i < chunks.size(); i++)
+            {
+                chunks[i].PositionBase = (int)Positions.size();
+                chunks[i].TCoordBase = (int)TCoords.size();
+                chunks[i].NormalBase = (int)Normals.size();
+                Append(Positions, chunks[i].Positions);
+                Append(TCoords, chunks[i].TCoords);
+                Append(Normals, chunks[i].Normals);
+            }
 
+            RunChunks(chunks.size(), [&](int i) { BuildChunk(chunks[i], Positions, TCoords, Normals); });
+
+            // The chunks hold complete vertices from now on
+            size_t positionCount = Positions.size(), tcoordCount = TCoords.size(), normalCount = Normals.size();
+            std::vector<Vector3>().swap(Positions);
+            std::vector<Vector2>().swap(TCoords);
+            std::vector<Vector3>().swap(Normals);
+            size_t triangleCount = 0;
+
+            // Stitch the chunks together in file order, splitting
+            // meshes at the statements that were recorded between faces
             std::vector<Vertex> Vertices;
             std::vector<unsigned int> Indices;
 
@@ -499,252 +814,155 @@ namespace objl
             bool listening = false;
             std::string meshname;
 
-            Mesh tempMesh;
+            // Names given to the meshes so far, and the next suffix
+            // to try for each name that had to be made unique
+            std::unordered_set<std::string> usedNames;
+            std::unordered_map<std::string, int> nextSuffix;
 
-            #ifdef OBJL_CONSOLE_OUTPUT
-            const unsigned int outputEveryNth = 1000;
-            unsigned int outputIndicator = outputEveryNth;
-            #endif
+            // Vertices of the current mesh by their OBJ indices
+            VertexMap shared;
+            std::vector<unsigned int> remap;
 
-            std::string curline;
-            while (std::getline(file, curline))
+            for (size_t c = 0; c < chunks.size(); c++)
             {
-                curline = trim(curline);
-
-                #ifdef OBJL_CONSOLE_OUTPUT
-                if ((outputIndicator = ((outputIndicator + 1) % outputEveryNth)) == 1)
+                Chunk &chunk = chunks[c];
+                size_t vertex = 0, index = 0;
+                for (size_t s = 0; s <= chunk.Statements.size(); s++)
                 {
-                    if (!meshname.empty())
-                    {
-                        std::cout
-                            << "\r- " << meshname
-                            << "\t| vertices > " << Positions.size()
-                            << "\t| texcoords > " << TCoords.size()
-                            << "\t| normals > " << Normals.size()
-                            << "\t| triangles > " << (Vertices.size() / 3)
-                            << (!MeshMatNames.empty() ? "\t| material: " + MeshMatNames.back() : "");
-                    }
-                }
-                #endif
-
-                // Generate a Mesh Object or Prepare for an object to be created
-                if (algorithm::firstToken(curline) == "o" || algorithm::firstToken(curline) == "g" || curline[0] == 'g')
-                {
-                    if (!listening)
+                    // Faces up to the next statement, corners with the same
+                    // position, texture coordinate and normal share a vertex
+                    size_t vertexEnd = s < chunk.Statements.size() ? chunk.Statements[s].Vertex : chunk.Vertices.size();
+                    size_t indexEnd = s < chunk.Statements.size() ? chunk.Statements[s].Index : chunk.Indices.size();
+                    remap.resize(vertexEnd - vertex);
+                    for (size_t i = vertex; i < vertexEnd; i++)
                     {
-                        listening = true;
-
-                        if (algorithm::firstToken(curline) == "o" || algorithm::firstToken(curline) == "g")
-                        {
-                            meshname = algorithm::tail(curline);
-                        }
-                        else
-                        {
-                            meshname = "unnamed";
-                        }
-                    }
-                    else
-                    {
-                        // Generate the mesh to put into the array
-
-                        if (!Indices.empty() && !Vertices.empty())
+                        const VertexKey &key = chunk.Keys[i];
+                        if (key.Position >= 0)
                         {
-                            // Create Mesh
-                            tempMesh = Mesh(Vertices, Indices);
-                            tempMesh.MeshName = meshname;
-
-                            // Insert Mesh
-                            LoadedMeshes.push_back(tempMesh);
-
-                            // Cleanup
-                            Vertices.clear();
-                            Indices.clear();
-                            meshname.clear();
-
-                            meshname = algorithm::tail(curline);
-                        }
-                        else
-                        {
-                            if (algorithm::firstToken(curline) == "o" || algorithm::firstToken(curline) == "g")
-                            {
-                                meshname = algorithm::tail(curline);
-                            }
-                            else
+                            std::pair<VertexMap::iterator, bool> found = shared.insert(std::make_pair(key, (unsigned int)Vertices.size()));
+                            if (!found.second)
                             {
-                                meshname = "unnamed";
+                                remap[i - vertex] = found.first->second;
+                                continue;
                             }
                         }
+                        remap[i - vertex] = (unsigned int)Vertices.size();
+                        Vertices.push_back(chunk.Vertices[i]);
+                        if (KeepLoadedVertices)
+                            LoadedVertices.push_back(chunk.Vertices[i]);
                     }
-                    #ifdef OBJL_CONSOLE_OUTPUT
-                    std::cout << std::endl;
-                    outputIndicator = 0;
-                    #endif
-                }
-                // Generate a Vertex Position
-                if (algorithm::firstToken(curline) == "v")
-                {
-                    std::vector<std::string> spos;
-                    Vector3 vpos;
-                    algorithm::split(algorithm::tail(curline), spos, " ");
-
-                    vpos.X = std::stof(spos[0]);
-                    vpos.Y = std::stof(spos[1]);
-                    vpos.Z = std::stof(spos[2]);
-
-                    Positions.push_back(vpos);
-                }
-                // Generate a Vertex Texture Coordinate
-                if (algorithm::firstToken(curline) == "vt")
-                {
-                    std::vector<std::string> stex;
-                    Vector2 vtex;
-                    algorithm::split(algorithm::tail(curline), stex, " ");
-
-                    vtex.X = std::stof(stex[0]);
-                    vtex.Y = std::stof(stex[1]);
-
-                    TCoords.push_back(vtex);
-                }
-                // Generate a Vertex Normal;
-                if (algorithm::firstToken(curline) == "vn")
-                {
-                    std::vector<std::string> snor;
-                    Vector3 vnor;
-                    algorithm::split(algorithm::tail(curline), snor, " ");
-
-                    vnor.X = std::stof(snor[0]);
-                    vnor.Y = std::stof(snor[1]);
-                    vnor.Z = std::stof(snor[2]);
-
-                    Normals.push_back(vnor);
-                }
-                // Generate a Face (vertices & indices)
-                if (algorithm::firstToken(curline) == "f")
-                {
-                    // Generate the vertices
-                    std::vector<Vertex> vVerts;
-                    GenVerticesFromRawOBJ(vVerts, Positions, TCoords, Normals, curline);
-
-                    // Add Vertices
-                    for (int i = 0; i < int(vVerts.size()); i++)
+                    unsigned int meshStart = (unsigned int)(LoadedVertices.size() - Vertices.size());
+                    for (size_t i = index; i < indexEnd; i++)
                     {
-                        Vertices.push_back(vVerts[i]);
-
-                        LoadedVertices.push_back(vVerts[i]);
+                        unsigned int indnum = remap[chunk.Indices[i] - vertex];
+                        Indices.push_back(indnum);
+                        if (KeepLoadedVertices)
+                            LoadedIndices.push_back(meshStart + indnum);
                     }
+                    triangleCount += (indexEnd - index) / 3;
+                    vertex = vertexEnd;
+                    index = indexEnd;
 
-                    std::vector<unsigned int> iIndices;
-
-                    VertexTriangluation(iIndices, vVerts);
-
-                    // Add Indices
-                    for (int i = 0; i < int(iIndices.size()); i++)
+                    if (s == chunk.Statements.size())
                     {
-                        unsigned int indnum = (unsigned int)((Vertices.size()) - vVerts.size()) + iIndices[i];
-                        Indices.push_back(indnum);
-
-                        indnum = (unsigned int)((LoadedVertices.size()) - vVerts.size()) + iIndices[i];
-                        LoadedIndices.push_back(indnum);
-
+                        // Done with this chunk
+                        std::vector<Vertex>().swap(chunk.Vertices);
+                        std::vector<VertexKey>().swap(chunk.Keys);
+                        std::vector<unsigned int>().swap(chunk.Indices);
+                        break;
                     }
-                }
-                // Get Mesh Material Name
-                if (algorithm::firstToken(curline) == "usemtl")
-                {
-                    MeshMatNames.push_back(algorithm::tail(curline));
 
-                    // Create new Mesh, if Material changes within a group
-                    if (!Indices.empty() && !Vertices.empty())
+                    const Statement &statement = chunk.Statements[s];
+                    switch (statement.Kind)
                     {
-                        // Create Mesh
-                        tempMesh = Mesh(Vertices, Indices);
-                        tempMesh.MeshName = meshname;
-                        int i = 2;
-                        while(1) {
-                            tempMesh.MeshName = meshname + "_" + std::to_string(i);
-
-                            for (auto &m : LoadedMeshes)
-                                if (m.MeshName == tempMesh.MeshName)
-                                    continue;
-                            break;
+                    // Generate a Mesh Object or Prepare for an object to be created
+                    case Statement::GROUP:
+                        if (!listening)
+                        {
+                            listening = true;
+                            meshname = statement.Named ? text::Tail(statement.Line) : "unnamed";
                         }
+                        else
+                        {
+                            // Generate the mesh to put into the array
 
-                        // Insert Mesh
-                        LoadedMeshes.push_back(tempMesh);
-
-                        // Cleanup
-                        Vertices.clear();
-                        Indices.clear();
-                    }
-
-                    #ifdef OBJL_CONSOLE_OUTPUT
-                    outputIndicator = 0;
-                    #endif
-                }
-                // Load Materials
-                if (algorithm::firstToken(curline) == "mtllib")
-                {
-                    // Generate LoadedMaterial
+                            if (!Indices.empty() && !Vertices.empty())
+                            {
+                                // Insert Mesh
+                                AddMesh(Vertices, Indices, meshname);
+                                usedNames.insert(meshname);
+                                shared.clear();
 
-                    // Generate a path to the material file
-                    std::vector<std::string> temp;
-                    algorithm::split(Path, temp, "/");
+                                meshname = text::Tail(statement.Line);
+                            }
+                            else
+                            {
+                                meshname = statement.Named ? text::Tail(statement.Line) : "unnamed";
+                            }
+                        }
+                        #ifdef OBJL_CONSOLE_OUTPUT
+                        std::cout << "- " << meshname << std::endl;
+                        #endif
+                        break;
 
-                    std::string pathtomat = "";
+                    // Get Mesh Material Name
+                    case Statement::USEMTL:
+                        MeshMatNames.push_back(text::Tail(statement.Line));
 
-                    if (temp.size() != 1)
-                    {
-                        for (unsigned int i = 0; i < temp.size() - 1; i++)
+                        // Create new Mesh, if Material changes within a group
+                        if (!Indices.empty() && !Vertices.empty())
                         {
-                            pathtomat += temp[i] + "/";
+                            // First free name_2, name_3, ...
+                            int &i = nextSuffix.insert(std::make_pair(meshname, 2)).first->second;
+                            std::string name = meshname + "_" + std::to_string(i++);
+                            while (usedNames.count(name))
+                                name = meshname + "_" + std::to_string(i++);
+
+                            // Insert Mesh
+                            AddMesh(Vertices, Indices, name);
+                            usedNames.insert(name);
+                            shared.clear();
                         }
+                        break;
                     }
-
-
-                    pathtomat += algorithm::tail(curline);
-
-                    #ifdef OBJL_CONSOLE_OUTPUT
-                    std::cout << std::endl << "- find materials in: " << pathtomat << std::endl;
-                    #endif
-
-                    // Load Materials
-                    LoadMaterials(pathtomat);
                 }
             }
 
             #ifdef OBJL_CONSOLE_OUTPUT
-            std::cout << std::endl;
+            std::cout
+                << "- " << chunks.size() << " chunk(s)"
+                << "\t| vertices > " << positionCount
+                << "\t| texcoords > " << tcoordCount
+                << "\t| normals > " << normalCount
+                << "\t| triangles > " << triangleCount
+                << std::endl;
             #endif
 
             // Deal with last mesh
 
             if (!Indices.empty() && !Vertices.empty())
             {
-                // Create Mesh
-                tempMesh = Mesh(Vertices, Indices);
-                tempMesh.MeshName = meshname;
-
                 // Insert Mesh
-                LoadedMeshes.push_back(tempMesh);
+                AddMesh(Vertices, Indices, meshname);
             }
 
-            file.close();
+            // The statements point into the file
+            chunks.clear();
+            file.Close();
+
+            // Index the materials by name, the first one wins
+            std::unordered_map<std::string, size_t> materialIndex;
+            for (size_t j = 0; j < LoadedMaterials.size(); j++)
+                materialIndex.insert(std::make_pair(LoadedMaterials[j].name, j));
 
             // Set Materials for each Mesh
-            for (unsigned int i = 0; i < MeshMatNames.size(); i++)
+            for (size_t i = 0; i < MeshMatNames.size() && i < LoadedMeshes.size(); i++)
             {
-                std::string matname = MeshMatNames[i];
-
                 // Find corresponding material name in loaded materials
                 // when found copy material variables into mesh material
-                for (unsigned int j = 0; j < LoadedMaterials.size(); j++)
-                {
-                    if (LoadedMaterials[j].name == matname)
-                    {
-                        LoadedMeshes[i].MeshMaterial = LoadedMaterials[j];
-                        break;
-                    }
-                }
+                auto found = materialIndex.find(MeshMatNames[i]);
+                if (found != materialIndex.end())
+                    LoadedMeshes[i].MeshMaterial = LoadedMaterials[found->second];
             }
 
             if (LoadedMeshes.empty() && LoadedVertices.empty() && LoadedIndices.empty())
@@ -759,112 +977,407 @@ namespace objl
 
         // Loaded Mesh Objects
         std::vector<Mesh> LoadedMeshes;
-        // Loaded Vertex Objects
+        // Loaded Vertex Objects, all the meshes one after the other
         std::vector<Vertex> LoadedVertices;
-        // Loaded Index Positions
+        // Loaded Index Positions into LoadedVertices
         std::vector<unsigned int> LoadedIndices;
+        // Whether to fill LoadedVertices and LoadedIndices, which
+        // hold a second copy of every mesh
+        bool KeepLoadedVertices;
+        // Whether faces without normals get the face normal on vertices
+        // of their own, or share vertices like any other face and leave
+        // the normal zero for the caller to fill in
+        bool FlatNormals;
         // Loaded Material Objects
         std::vector<Material> LoadedMaterials;
+        // Paths of the mtllib files named by the OBJ, found or not
+        std::vector<std::string> MaterialFiles;
+        // Called for every material as soon as its mtllib has been read,
+        // which is before any of the faces are parsed
+        std::function<void(const Material &)> MaterialLoaded;
+        // Runs task(0) ... task(count - 1), possibly concurrently;
+        // the chunks are processed one after the other when not set
+        std::function<void(int count, const std::function<void(int)> &task)> ParallelFor;
+        // Approximate size of the pieces the file is parsed in
+        size_t ChunkBytes;
 
     private:
-        // Generate vertices from a list of positions, 
-        //    tcoords, normals and a face line
-        void GenVerticesFromRawOBJ(std::vector<Vertex>& oVerts,
-            const std::vector<Vector3>& iPositions,
-            const std::vector<Vector2>& iTCoords,
-            const std::vector<Vector3>& iNormals,
-            std::string icurline)
+        // A face corner, with 0 based indices. Negative OBJ indices
+        // are relative to the elements read so far, so until the
+        // chunk knows where its elements start they are kept
+        // relative to the chunk and flagged as such.
+        struct Corner
         {
-            std::vector<std::string> sface, svert;
-            Vertex vVert;
-            algorithm::split(algorithm::tail(icurline), sface, " ");
+            enum Flags
+            {
+                HAS_TEXTURE = 1,
+                HAS_NORMAL = 2,
+                RELATIVE_POSITION = 4,
+                RELATIVE_TEXTURE = 8,
+                RELATIVE_NORMAL = 16
+            };
+
+            int Position;
+            int TextureCoordinate;
+            int Normal;
+            int Flags;
+        };
+
+        // The global 0 based OBJ indices a vertex was made from, -1 for
+        // missing ones. Vertices whose normal was computed from their
+        // face are never shared and have a Position of -1.
+        struct VertexKey
+        {
+            int Position;
+            int TextureCoordinate;
+            int Normal;
 
-            bool noNormal = false;
+            bool operator==(const VertexKey& other) const
+            {
+                return Position == other.Position && TextureCoordinate == other.TextureCoordinate && Normal == other.Normal;
+            }
+        };
 
-            // For every given vertex do this
-            for (int i = 0; i < int(sface.size()); i++)
+        struct VertexKeyHash
+        {
+            size_t operator()(const VertexKey& key) const
             {
-                // See What type the vertex is.
-                int vtype(0);
+                uint64_t h = (uint32_t)key.Position;
+                h = h * 0x9E3779B97F4A7C15ULL + (uint32_t)key.TextureCoordinate;
+                h = h * 0x9E3779B97F4A7C15ULL + (uint32_t)key.Normal;
+                return (size_t)(h ^ (h >> 29));
+            }
+        };
 
-                algorithm::split(sface[i], svert, "/");
+        typedef std::unordered_map<VertexKey, unsigned int, VertexKeyHash> VertexMap;
 
-                // Check for just position - v1
-                if (svert.size() == 1)
-                {
-                    // Only position
-                    vtype = 1;
-                }
+        // A statement that splits meshes, kept to be replayed in order
+        struct Statement
+        {
+            enum Type { GROUP, USEMTL };
+
+            Type Kind;
+            // Whether a group statement gives a name
+            bool Named;
+            // The line, to read the name from
+            const char *Line;
+            // Faces of the chunk before it
+            size_t Face;
+            // Vertices and indices of the chunk before it
+            size_t Vertex;
+            size_t Index;
+        };
+
+        struct Chunk
+        {
+            const char *Begin;
+            const char *End;
+
+            // Parsed records
+            std::vector<Vector3> Positions;
+            std::vector<Vector2> TCoords;
+            std::vector<Vector3> Normals;
+            std::vector<Corner> Corners;
+            std::vector<unsigned int> FaceSizes;
+            std::vector<Statement> Statements;
+
+            // Global index of the first element of each kind
+            int PositionBase;
+            int TCoordBase;
+            int NormalBase;
+
+            // Triangulated faces, indices are relative to the chunk
+            std::vector<Vertex> Vertices;
+            std::vector<VertexKey> Keys;
+            std::vector<unsigned int> Indices;
+        };
+
+        // Moves the vertices and indices into a new mesh, leaving them empty
+        void AddMesh(std::vector<Vertex> &vertices, std::vector<unsigned int> &indices, const std::string &name)
+        {
+            LoadedMeshes.push_back(Mesh());
+            Mesh &mesh = LoadedMeshes.back();
+            mesh.MeshName = name;
+            mesh.Vertices.swap(vertices);
+            mesh.Indices.swap(indices);
+        }
+
+        // Element at a 0 based index, or a default one when out of range
+        template <class T>
+        static const T & Element(const std::vector<T> &elements, int idx)
+        {
+            static const T none;
+            if (idx < 0 || idx >= int(elements.size()))
+                return none;
+            return elements[idx];
+        }
+
+        // Moves the contents of from to the end of to
+        template <class T>
+        static void Append(std::vector<T> &to, std::vector<T> &from)
+        {
+            if (to.empty())
+                to.swap(from);
+            else
+                to.insert(to.end(), from.begin(), from.end());
+            std::vector<T>().swap(from);
+        }
+
+        void RunChunks(size_t count, const std::function<void(int)> &task)
+        {
+            if (ParallelFor && count > 1)
+            {
+                ParallelFor((int)count, task);
+            }
+            else
+            {
+                for (size_t i = 0; i < count; i++)
+                    task((int)i);
+            }
+        }
 
-                // Check for position & texture - v1/vt1
-                if (svert.size() == 2)
+        static bool ParseCorner(const char *&p, Corner &corner, const Chunk &chunk)
+        {
+            int v, vt = 0, vn = 0;
+            corner.Flags = 0;
+
+            // v1, v1/vt1, v1//vn1 or v1/vt1/vn1
+            if (!text::ParseIndex(p, v))
+                return false;
+            if (*p == '/')
+            {
+                p++;
+                if (*p != '/' && text::ParseIndex(p, vt))
+                    corner.Flags |= Corner::HAS_TEXTURE;
+                if (*p == '/')
                 {
-                    // Position & Texture
-                    vtype = 2;
+                    p++;
+                    if (text::ParseIndex(p, vn))
+                        corner.Flags |= Corner::HAS_NORMAL;
                 }
+            }
 
-                // Check for Position, Texture and Normal - v1/vt1/vn1
-                // or if Position and Normal - v1//vn1
-                if (svert.size() == 3)
+            corner.Position = v < 0 ? int(chunk.Positions.size()) + v : v - 1;
+            corner.TextureCoordinate = vt < 0 ? int(chunk.TCoords.size()) + vt : vt - 1;
+            corner.Normal = vn < 0 ? int(chunk.Normals.size()) + vn : vn - 1;
+            if (v < 0)
+                corner.Flags |= Corner::RELATIVE_POSITION;
+            if (vt < 0)
+                corner.Flags |= Corner::RELATIVE_TEXTURE;
+            if (vn < 0)
+                corner.Flags |= Corner::RELATIVE_NORMAL;
+            return true;
+        }
+
+        static void AddStatement(Chunk &chunk, Statement::Type kind, bool named, const char *line)
+        {
+            Statement statement;
+            statement.Kind = kind;
+            statement.Named = named;
+            statement.Line = line;
+            statement.Face = chunk.FaceSizes.size();
+            statement.Vertex = statement.Index = 0;
+            chunk.Statements.push_back(statement);
+        }
+
+        // Start of every mtllib line between begin and end, in file order.
+        // Jumps from one 'm' to the next, which costs little next to
+        // parsing the chunks
+        static std::vector<const char *> FindMaterialLibraries(const char *begin, const char *end)
+        {
+            std::vector<const char *> lines;
+            for (const char *p = begin; (p = (const char *)memchr(p, 'm', end - p)); p++)
+            {
+                const char *line = p;
+                while (line > begin && text::IsBlank(line[-1]))
+                    line--;
+                if ((line == begin || line[-1] == '\n') && text::IsKeyword(p, "mtllib"))
+                    lines.push_back(p);
+            }
+            return lines;
+        }
+
+        // Reads the records of one chunk, one keyword dispatch per line
+        static void ParseChunk(Chunk &chunk)
+        {
+            for (const char *line = chunk.Begin; line < chunk.End; line = text::NextLine(line, chunk.End))
+            {
+                const char *p = text::SkipBlanks(line);
+
+                switch (p[0])
                 {
-                    if (svert[1] != "")
+                case 'v':
+                    // Generate a Vertex Position
+                    if (text::IsSeparator(p[1]))
                     {
-                        // Position, Texture, and Normal
-                        vtype = 4;
+                        Vector3 vpos;
+                        p += 1;
+                        text::ParseFloat(p, vpos.X);
+                        text::ParseFloat(p, vpos.Y);
+                        text::ParseFloat(p, vpos.Z);
+                        chunk.Positions.push_back(vpos);
                     }
-                    else
+                    // Generate a Vertex Texture Coordinate
+                    else if (p[1] == 't' && text::IsSeparator(p[2]))
                     {
-                        // Position & Normal
-                        vtype = 3;
+                        Vector2 vtex;
+                        p += 2;
+                        text::ParseFloat(p, vtex.X);
+                        text::ParseFloat(p, vtex.Y);
+                        chunk.TCoords.push_back(vtex);
                     }
-                }
+                    // Generate a Vertex Normal
+                    else if (p[1] == 'n' && text::IsSeparator(p[2]))
+                    {
+                        Vector3 vnor;
+                        p += 2;
+                        text::ParseFloat(p, vnor.X);
+                        text::ParseFloat(p, vnor.Y);
+                        text::ParseFloat(p, vnor.Z);
+                        chunk.Normals.push_back(vnor);
+                    }
+                    break;
 
-                // Calculate and store the vertex
-                switch (vtype)
-                {
-                case 1: // P
-                {
-                    vVert.Position = algorithm::getElement(iPositions, svert[0]);
-                    vVert.TextureCoordinate = Vector2(0, 0);
-                    noNormal = true;
-                    oVerts.push_back(vVert);
+                case 'f':
+                    // Face corners
+                    if (text::IsSeparator(p[1]))
+                    {
+                        unsigned int count = 0;
+                        Corner corner;
+                        p += 1;
+                        while (true)
+                        {
+                            p = text::SkipBlanks(p);
+                            if (text::IsLineEnd(*p))
+                                break;
+                            if (ParseCorner(p, corner, chunk))
+                            {
+                                chunk.Corners.push_back(corner);
+                                count++;
+                            }
+                            p = text::SkipToken(p);
+                        }
+                        chunk.FaceSizes.push_back(count);
+                    }
+                    break;
+
+                case 'o':
+                case 'g':
+                    // Any line starting with 'g' opens a group, only "o" and "g" name it
+                    if (p[0] == 'g' || text::IsSeparator(p[1]))
+                        AddStatement(chunk, Statement::GROUP, text::IsSeparator(p[1]), p);
+                    break;
+
+                case 'u':
+                    if (text::IsKeyword(p, "usemtl"))
+                        AddStatement(chunk, Statement::USEMTL, true, p);
+                    break;
+
+                default:
+                    // Comments, blank lines and unsupported statements
                     break;
                 }
-                case 2: // P/T
+            }
+        }
+
+        // Turns the faces of a chunk into vertices and triangles,
+        // once the global arrays they index are complete
+        void BuildChunk(Chunk &chunk,
+            const std::vector<Vector3>& iPositions,
+            const std::vector<Vector2>& iTCoords,
+            const std::vector<Vector3>& iNormals)
+        {
+            std::vector<Vertex> vVerts;
+            std::vector<unsigned int> iIndices;
+
+            size_t corner = 0;
+            size_t statement = 0;
+            for (size_t f = 0; f <= chunk.FaceSizes.size(); f++)
+            {
+                for (; statement < chunk.Statements.size() && chunk.Statements[statement].Face == f; statement++)
                 {
-                    vVert.Position = algorithm::getElement(iPositions, svert[0]);
-                    vVert.TextureCoordinate = algorithm::getElement(iTCoords, svert[1]);
-                    noNormal = true;
-                    oVerts.push_back(vVert);
+                    chunk.Statements[statement].Vertex = chunk.Vertices.size();
+                    chunk.Statements[statement].Index = chunk.Indices.size();
+                }
+                if (f == chunk.FaceSizes.size())
                     break;
+
+                // Generate the vertices
+                vVerts.clear();
+                GenVerticesFromCorners(vVerts, chunk.Keys, iPositions, iTCoords, iNormals,
+                    chunk, chunk.Corners.data() + corner, chunk.FaceSizes[f]);
+                corner += chunk.FaceSizes[f];
+
+                iIndices.clear();
+                VertexTriangluation(iIndices, vVerts);
+
+                // Add Indices
+                for (int i = 0; i < int(iIndices.size()); i++)
+                    chunk.Indices.push_back((unsigned int)chunk.Vertices.size() + iIndices[i]);
+
+                // Add Vertices
+                chunk.Vertices.insert(chunk.Vertices.end(), vVerts.begin(), vVerts.end());
+            }
+
+            std::vector<Corner>().swap(chunk.Corners);
+            std::vector<unsigned int>().swap(chunk.FaceSizes);
+        }
+
+        // Generate vertices from a list of positions,
+        //    tcoords, normals and the corners of a face
+        //    and append the indices they came from to oKeys
+        void GenVerticesFromCorners(std::vector<Vertex>& oVerts,
+            std::vector<VertexKey>& oKeys,
+            const std::vector<Vector3>& iPositions,
+            const std::vector<Vector2>& iTCoords,
+            const std::vector<Vector3>& iNormals,
+            const Chunk &chunk, const Corner *corners, unsigned int count)
+        {
+            Vertex vVert;
+
+            bool noNormal = false;
+
+            // For every given vertex do this
+            for (unsigned int i = 0; i < count; i++)
+            {
+                const Corner &c = corners[i];
+                VertexKey key;
+
+                // Calculate and store the vertex
+                key.Position = c.Position + (c.Flags & Corner::RELATIVE_POSITION ? chunk.PositionBase : 0);
+                vVert.Position = Element(iPositions, key.Position);
+
+                if (c.Flags & Corner::HAS_TEXTURE)
+                {
+                    key.TextureCoordinate = c.TextureCoordinate + (c.Flags & Corner::RELATIVE_TEXTURE ? chunk.TCoordBase : 0);
+                    vVert.TextureCoordinate = Element(iTCoords, key.TextureCoordinate);
                 }
-                case 3: // P//N
+                else
                 {
-                    vVert.Position = algorithm::getElement(iPositions, svert[0]);
+                    key.TextureCoordinate = -1;
                     vVert.TextureCoordinate = Vector2(0, 0);
-                    vVert.Normal = algorithm::getElement(iNormals, svert[2]);
-                    oVerts.push_back(vVert);
-                    break;
                 }
-                case 4: // P/T/N
+
+                if (c.Flags & Corner::HAS_NORMAL)
                 {
-                    vVert.Position = algorithm::getElement(iPositions, svert[0]);
-                    vVert.TextureCoordinate = algorithm::getElement(iTCoords, svert[1]);
-                    vVert.Normal = algorithm::getElement(iNormals, svert[2]);
-                    oVerts.push_back(vVert);
-                    break;
+                    key.Normal = c.Normal + (c.Flags & Corner::RELATIVE_NORMAL ? chunk.NormalBase : 0);
+                    vVert.Normal = Element(iNormals, key.Normal);
                 }
-                default:
+                else
                 {
-                    break;
-                }
+                    key.Normal = -1;
+                    vVert.Normal = Vector3(0, 0, 0);
+                    noNormal = true;
                 }
+
+                oVerts.push_back(vVert);
+                oKeys.push_back(key);
             }
 
             // take care of missing normals
             // these may not be truly acurate but it is the 
             // best they get for not compiling a mesh with normals    
-            if (noNormal)
+            if (noNormal && FlatNormals && oVerts.size() >= 3)
             {
                 Vector3 A = oVerts[0].Position - oVerts[1].Position;
                 Vector3 B = oVerts[2].Position - oVerts[1].Position;
@@ -876,6 +1389,17 @@ namespace objl
                     oVerts[i].Normal = normal;
                 }
             }
+
+            // Out of range indices all read as zero, the same as a missing one
+            for (size_t i = oKeys.size() - count; i < oKeys.size(); i++)
+            {
+                if ((noNormal && FlatNormals) || oKeys[i].Position < 0 || oKeys[i].Position >= int(iPositions.size()))
+                    oKeys[i].Position = -1;
+                if (oKeys[i].TextureCoordinate < 0 || oKeys[i].TextureCoordinate >= int(iTCoords.size()))
+                    oKeys[i].TextureCoordinate = -1;
+                if (oKeys[i].Normal < 0 || oKeys[i].Normal >= int(iNormals.size()))
+                    oKeys[i].Normal = -1;
+            }
         }
 
         // Triangulate a list of vertices into a face by printing
@@ -899,6 +1423,20 @@ namespace objl
                 return;
             }
 
+            // Convex faces are a fan around the last vertex, the
+            //    same triangles clipping ears from the start would give
+            if (algorithm::IsConvexPolygon(iVerts.data(), iVerts.size()))
+            {
+                unsigned int last = (unsigned int)iVerts.size() - 1;
+                for (unsigned int i = 0; i + 1 < last; i++)
+                {
+                    oIndices.push_back(i);
+                    oIndices.push_back(i + 1);
+                    oIndices.push_back(last);
+                }
+                return;
+            }
+
             // Create a list of vertices
             std::vector<Vertex> tVerts = iVerts;
 
@@ -0,0 +1,62 @@
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include "parallel.h"
+
+int parallel_threads() {
+    static const int n = std::max(1u, std::thread::hardware_concurrency());
+    return n;
+}
+
+void parallel_for(int begin, int end, int grain, const std::function<void(int, int)> &body) {
+    if (end <= begin) return;
+    if (grain < 1) grain = 1;
+    int nchunks = std::min(parallel_threads(), (end - begin + grain - 1) / grain);
+    if (nchunks <= 1) {
+        body(begin, end);
+        return;
+    }
+
+    int chunk = (end - begin + nchunks - 1) / nchunks;
+    std::vector<std::thread> workers;
+    for (int b = begin + chunk; b < end; b += chunk) {
+        workers.push_back(std::thread(body, b, std::min(end, b + chunk)));
+    }
+    body(begin, std::min(end, begin + chunk));
+    for (auto & w : workers) w.join();
+}
+
+ThreadPool::ThreadPool(int nthreads) : stopping(false) {
+    for (int i=0; i<std::max(1, nthreads); i++) {
+        workers.push_back(std::thread(&ThreadPool::run, this));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto & w : workers) w.join();
+}
+
+ThreadPool &ThreadPool::shared() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::run() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeup.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) return; // stopping, and the queue is drained
+            task.swap(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,84 @@
+/*
+ * Tiny Renderer, https://github.com/ssloy/tinyrenderer
+ * Copyright Dmitry V. Sokolov
+ * zlib license
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not
+ *    be misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#pragma once
+
+#ifndef PARALLEL_H_FB9A75BA_CB5C_11F1_9159_02FC00000001
+#define PARALLEL_H_FB9A75BA_CB5C_11F1_9159_02FC00000001
+
+#include <functional>
+#include <memory>
+#include <future>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Number of worker threads used by parallel_for (at least 1)
+int parallel_threads();
+
+// Splits [begin, end) into contiguous chunks of at least grain items and
+// calls body(chunk_begin, chunk_end) for each of them, spreading the chunks
+// over the available cores. The calling thread takes part and the call
+// returns once every chunk is done. Small ranges run inline.
+void parallel_for(int begin, int end, int grain, const std::function<void(int, int)> &body);
+
+// A fixed set of worker threads running queued tasks in submission order
+class ThreadPool {
+public:
+    ThreadPool(int nthreads = parallel_threads());
+    ~ThreadPool();
+
+    // Queues f() and returns a future for its result
+    template <typename F> std::future<typename std::result_of<F()>::type> submit(F f) {
+        typedef typename std::result_of<F()>::type R;
+        std::shared_ptr<std::packaged_task<R()> > task = std::make_shared<std::packaged_task<R()> >(f);
+        std::future<R> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back([task]() { (*task)(); });
+        }
+        wakeup.notify_one();
+        return result;
+    }
+
+    // Process-wide pool for background work such as texture decoding
+    static ThreadPool &shared();
+
+private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool & operator =(const ThreadPool &);
+
+    void run();
+
+    std::deque<std::function<void()> > tasks;
+    bool stopping;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<std::thread> workers;
+};
+
+#endif // PARALLEL_H_FB9A75BA_CB5C_11F1_9159_02FC00000001
@@ -1,6 +1,10 @@
 #include <cmath>
 #include <limits>
 #include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <cassert>
 
 #include "render.h"
 
@@ -91,3 +95,373 @@ void triangle(mat<4,3,float> &clipc, IShader &shader, Image &image, float *zbuff
     }
 }
 
+
+// 4x rotated grid, as offsets from the pixel center in 1/16 of a pixel
+static const int MSAA_PATTERN[MSAA_SAMPLES][2] = { { -2, -6 }, { 6, -2 }, { -6, 2 }, { 2, 6 } };
+
+MultisampleBuffer::MultisampleBuffer(int w, int h, int bpp) :
+    width(w), height(h), bytespp(bpp),
+    depth((size_t)w*h*MSAA_SAMPLES), color((size_t)w*h*MSAA_SAMPLES*bpp), normals((size_t)w*h*MSAA_SAMPLES) {
+    clear();
+}
+
+void MultisampleBuffer::clear() {
+    std::fill(depth.begin(), depth.end(), -std::numeric_limits<float>::max());
+    std::fill(color.begin(), color.end(), 0);
+    std::fill(normals.begin(), normals.end(), Vec3f());
+}
+
+void MultisampleBuffer::resolve(Image &image, float *zbuffer, Vec3f *normals_buffer) {
+    assert(image.get_width() == width && image.get_height() == height && image.get_bytespp() == bytespp);
+    for (int p=0; p<width*height; p++) {
+        unsigned int mask = 0;
+        for (int s=0; s<MSAA_SAMPLES; s++) {
+            if (depth[p*MSAA_SAMPLES + s] > -std::numeric_limits<float>::max()) mask |= 1u << s;
+        }
+        if (!mask) continue;
+
+        unsigned char *out = image.buffer() + p*bytespp;
+        unsigned int sum[4] = { 0, 0, 0, 0 };
+        unsigned int alpha = 0;
+        float z = zbuffer[p];
+        Vec3f n;
+        for (int s=0; s<MSAA_SAMPLES; s++) {
+            const unsigned char *c = out;
+            if (mask & (1u << s)) {
+                c = &color[(p*MSAA_SAMPLES + s)*bytespp];
+                z = std::max(z, depth[p*MSAA_SAMPLES + s]);
+                n = n + normals[p*MSAA_SAMPLES + s];
+            } else if (normals_buffer) {
+                n = n + normals_buffer[p];
+            }
+            if (bytespp == Image::RGBA) {
+                // straight alpha: weight the colors by their coverage
+                for (int k=0; k<3; k++) sum[k] += c[k]*c[3];
+                alpha += c[3];
+            } else {
+                for (int k=0; k<bytespp; k++) sum[k] += c[k];
+            }
+        }
+        if (bytespp == Image::RGBA) {
+            for (int k=0; k<3; k++) out[k] = alpha ? (sum[k] + alpha/2) / alpha : 0;
+            out[3] = (alpha + MSAA_SAMPLES/2) / MSAA_SAMPLES;
+        } else {
+            for (int k=0; k<bytespp; k++) out[k] = (sum[k] + MSAA_SAMPLES/2) / MSAA_SAMPLES;
+        }
+        zbuffer[p] = z;
+        if (normals_buffer) normals_buffer[p] = n.norm() > 0 ? n.normalize() : n;
+    }
+}
+
+void triangle(mat<4,3,float> &clipc, IShader &shader, MultisampleBuffer &samples, bool reverse_pov) {
+    mat<3,4,float> pts  = (Viewport*clipc).transpose(); // transposed to ease access to each of the points
+    mat<3,2,float> pts2;
+    for (int i=0; i<3; i++) pts2[i] = proj<2>(pts[i]/pts[i][3]);
+
+    Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+    for (int i=0; i<3; i++) {
+        for (int j=0; j<2; j++) {
+            bboxmin[j] = std::min(bboxmin[j], pts2[i][j]);
+            bboxmax[j] = std::max(bboxmax[j], pts2[i][j]);
+        }
+    }
+    // the samples reach half a pixel away from the pixel centers
+    int xmin = std::max(0, (int)std::floor(bboxmin.x - .5f));
+    int ymin = std::max(0, (int)std::floor(bboxmin.y - .5f));
+    int xmax = std::min(samples.width - 1,  (int)std::ceil(bboxmax.x + .5f));
+    int ymax = std::min(samples.height - 1, (int)std::ceil(bboxmax.y + .5f));
+
+    ImageColor color;
+    Vec3f normal;
+    float sample_depth[MSAA_SAMPLES];
+    for (int x=xmin; x<=xmax; x++) {
+        for (int y=ymin; y<=ymax; y++) {
+            const int p = x + y*samples.width;
+            unsigned int mask = 0;
+            Vec2f centroid;
+            for (int s=0; s<MSAA_SAMPLES; s++) {
+                Vec2f P(x + MSAA_PATTERN[s][0]/16.f, y + MSAA_PATTERN[s][1]/16.f);
+                Vec3f bc_screen = barycentric(pts2[0], pts2[1], pts2[2], P);
+                if (bc_screen.x<0 || bc_screen.y<0 || bc_screen.z<0) continue;
+                Vec3f bc_clip = Vec3f(bc_screen.x/pts[0][3], bc_screen.y/pts[1][3], bc_screen.z/pts[2][3]);
+                bc_clip = bc_clip/(bc_clip.x+bc_clip.y+bc_clip.z);
+                float frag_depth = clipc[2]*bc_clip;
+                if (reverse_pov) frag_depth = -frag_depth;
+                if (samples.depth[p*MSAA_SAMPLES + s] > frag_depth) continue;
+                sample_depth[s] = frag_depth;
+                mask |= 1u << s;
+                centroid = centroid + P;
+            }
+            if (!mask) continue;
+
+            // Shade once, at the pixel center when the triangle covers it,
+            // otherwise at the centroid of the covered samples
+            Vec2f P(x, y);
+            Vec3f bc_screen = barycentric(pts2[0], pts2[1], pts2[2], P);
+            if (bc_screen.x<0 || bc_screen.y<0 || bc_screen.z<0) {
+                int n = 0;
+                for (int s=0; s<MSAA_SAMPLES; s++) n += (mask >> s) & 1;
+                bc_screen = barycentric(pts2[0], pts2[1], pts2[2], centroid/(float)n);
+            }
+            Vec3f bc_clip = Vec3f(bc_screen.x/pts[0][3], bc_screen.y/pts[1][3], bc_screen.z/pts[2][3]);
+            bc_clip = bc_clip/(bc_clip.x+bc_clip.y+bc_clip.z);
+            if (shader.fragment(bc_clip, color, normal)) continue;
+
+            if (samples.bytespp == Image::RGBA && color.bytespp < 4) color[3] = 255;
+            for (int s=0; s<MSAA_SAMPLES; s++) {
+                if (!(mask & (1u << s))) continue;
+                samples.depth[p*MSAA_SAMPLES + s] = sample_depth[s];
+                samples.normals[p*MSAA_SAMPLES + s] = normal;
+                memcpy(&samples.color[(p*MSAA_SAMPLES + s)*samples.bytespp], color.rgba, samples.bytespp);
+            }
+        }
+    }
+}
+
+// Output pixels per tile side, not counting the one pixel border
+static const int SSAA_TILE_SIZE = 32;
+
+// Loads the tile, border included, with the current content of the output so
+// that whatever the model does not cover keeps it. Samples that fall outside
+// of the image are left empty.
+static void load_tile(Image &tile, float *tile_z, Vec3f *tile_n, int ssaa, int x0, int y0,
+        Image &image, float *zbuffer, Vec3f *normals_buffer) {
+    const int bpp = image.get_bytespp();
+    const int side = tile.get_width();
+    for (int ty=0; ty<side; ty++) {
+        for (int tx=0; tx<side; tx++) {
+            int i = tx + ty*side;
+            int px = x0 - 1 + tx / ssaa;
+            int py = y0 - 1 + ty / ssaa;
+            if (px < 0 || py < 0 || px >= image.get_width() || py >= image.get_height()) {
+                memset(tile.buffer() + i*bpp, 0, bpp);
+                tile_z[i] = -std::numeric_limits<float>::max();
+                if (tile_n) tile_n[i] = Vec3f();
+                continue;
+            }
+            int o = px + py*image.get_width();
+            memcpy(tile.buffer() + i*bpp, image.buffer() + o*bpp, bpp);
+            tile_z[i] = zbuffer[o];
+            if (tile_n) tile_n[i] = normals_buffer[o];
+        }
+    }
+}
+
+// Box filters the ssaa x ssaa samples of each pixel of the tile interior into
+// the output. Depth keeps the closest sample and normals are averaged.
+static void resolve_tile(Image &tile, float *tile_z, Vec3f *tile_n, int ssaa, int x0, int y0, int w, int h,
+        Image &image, float *zbuffer, Vec3f *normals_buffer) {
+    const int bpp = image.get_bytespp();
+    const int side = tile.get_width();
+    const int nsamples = ssaa * ssaa;
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            float depth = -std::numeric_limits<float>::max();
+            Vec3f normal;
+            unsigned int sum[4] = { 0, 0, 0, 0 };
+            unsigned int alpha = 0;
+            for (int sy=0; sy<ssaa; sy++) {
+                for (int sx=0; sx<ssaa; sx++) {
+                    int i = (x + 1)*ssaa + sx + ((y + 1)*ssaa + sy)*side;
+                    const unsigned char *c = tile.buffer() + i*bpp;
+                    depth = std::max(depth, tile_z[i]);
+                    if (tile_n) normal = normal + tile_n[i];
+                    if (bpp == Image::RGBA) {
+                        // straight alpha: weight the colors by their coverage
+                        for (int k=0; k<3; k++) sum[k] += c[k]*c[3];
+                        alpha += c[3];
+                    } else {
+                        for (int k=0; k<bpp; k++) sum[k] += c[k];
+                    }
+                }
+            }
+            int o = (x0 + x) + (y0 + y)*image.get_width();
+            unsigned char *out = image.buffer() + o*bpp;
+            if (bpp == Image::RGBA) {
+                for (int k=0; k<3; k++) out[k] = alpha ? (sum[k] + alpha/2) / alpha : 0;
+                out[3] = (alpha + nsamples/2) / nsamples;
+            } else {
+                for (int k=0; k<bpp; k++) out[k] = (sum[k] + nsamples/2) / nsamples;
+            }
+            zbuffer[o] = depth;
+            if (normals_buffer) normals_buffer[o] = normal.norm() > 0 ? normal.normalize() : normal;
+        }
+    }
+}
+
+void render_supersampled(int nfaces, IShader &shader, int ssaa, Image &image, float *zbuffer, bool reverse_pov, Vec3f *normals_buffer, const TilePass &tile_pass, const int *faces) {
+    if (ssaa < 1) ssaa = 1;
+    const Matrix screen = Viewport;
+    const int width = image.get_width();
+    const int height = image.get_height();
+
+    // Screen space bounding box of every face, to bin them into tiles
+    std::vector<Vec2f> bboxes(2*nfaces); // min, max
+    for (int i=0; i<nfaces; i++) {
+        Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+        Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+        const int face = faces ? faces[i] : i;
+        for (int j=0; j<3; j++) {
+            Vec4f p = screen * shader.vertex(face, j);
+            for (int k=0; k<2; k++) {
+                bboxmin[k] = std::min(bboxmin[k], p[k]/p[3]);
+                bboxmax[k] = std::max(bboxmax[k], p[k]/p[3]);
+            }
+        }
+        bboxes[2*i] = bboxmin;
+        bboxes[2*i + 1] = bboxmax;
+    }
+
+    const int side = (SSAA_TILE_SIZE + 2) * ssaa;
+    Image tile(side, side, image.get_bytespp(), Image::UNINITIALIZED);
+    std::vector<float> tile_z(side*side);
+    std::vector<Vec3f> tile_n(normals_buffer ? side*side : 0);
+    mat<4,3,float> clipc;
+
+    for (int y0=0; y0<height; y0+=SSAA_TILE_SIZE) {
+        for (int x0=0; x0<width; x0+=SSAA_TILE_SIZE) {
+            const int w = std::min(SSAA_TILE_SIZE, width - x0);
+            const int h = std::min(SSAA_TILE_SIZE, height - y0);
+            load_tile(tile, tile_z.data(), normals_buffer ? tile_n.data() : nullptr, ssaa, x0, y0, image, zbuffer, normals_buffer);
+
+            // Output pixel x is sampled at x + (i + .5)/ssaa - .5, i in [0, ssaa),
+            // which lands sample i of the pixel on an integer tile position
+            Matrix to_tile = Matrix::identity();
+            to_tile[0][0] = to_tile[1][1] = ssaa;
+            to_tile[0][3] = (ssaa - 1) / 2.f - (x0 - 1) * ssaa;
+            to_tile[1][3] = (ssaa - 1) / 2.f - (y0 - 1) * ssaa;
+            Viewport = to_tile * screen;
+
+            for (int i=0; i<nfaces; i++) {
+                const Vec2f &bboxmin = bboxes[2*i];
+                const Vec2f &bboxmax = bboxes[2*i + 1];
+                if (bboxmax.x < x0 - 2 || bboxmin.x > x0 + w + 2 || bboxmax.y < y0 - 2 || bboxmin.y > y0 + h + 2) continue;
+                const int face = faces ? faces[i] : i;
+                for (int j=0; j<3; j++) {
+                    clipc.set_col(j, shader.vertex(face, j));
+                }
+                triangle(clipc, shader, tile, tile_z.data(), reverse_pov, normals_buffer ? tile_n.data() : nullptr);
+            }
+
+            if (tile_pass) tile_pass(tile, tile_z.data(), normals_buffer ? tile_n.data() : nullptr, ssaa);
+            resolve_tile(tile, tile_z.data(), normals_buffer ? tile_n.data() : nullptr, ssaa, x0, y0, w, h, image, zbuffer, normals_buffer);
+        }
+    }
+
+    Viewport = screen;
+}
+
+void DepthPyramid::clear() {
+    levels.clear();
+    widths.clear();
+    heights.clear();
+}
+
+void DepthPyramid::build(const float *depth, int width, int height, int samples) {
+    clear();
+    int w = width, h = height;
+    for (;;) {
+        levels.push_back(std::vector<float>((size_t)w*h));
+        widths.push_back(w);
+        heights.push_back(h);
+        if (w == 1 && h == 1) break;
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+    update(depth, samples, 0, 0, width - 1, height - 1);
+}
+
+void DepthPyramid::update(const float *depth, int samples, int xmin, int ymin, int xmax, int ymax) {
+    if (levels.empty()) return;
+    const int width = widths[0];
+    for (int y=ymin; y<=ymax; y++) {
+        for (int x=xmin; x<=xmax; x++) {
+            const int p = x + y*width;
+            float z = depth[p*samples];
+            for (int s=1; s<samples; s++) z = std::min(z, depth[p*samples + s]);
+            levels[0][p] = z;
+        }
+    }
+    for (unsigned int k=1; k<levels.size(); k++) {
+        const std::vector<float> &prev = levels[k - 1];
+        std::vector<float> &next = levels[k];
+        const int w = widths[k - 1], h = heights[k - 1], nw = widths[k];
+        xmin >>= 1; ymin >>= 1; xmax >>= 1; ymax >>= 1;
+        for (int y=ymin; y<=ymax; y++) {
+            const int y0 = 2*y, y1 = std::min(2*y + 1, h - 1);
+            for (int x=xmin; x<=xmax; x++) {
+                const int x0 = 2*x, x1 = std::min(2*x + 1, w - 1);
+                next[x + y*nw] = std::min(std::min(prev[x0 + y0*w], prev[x1 + y0*w]), std::min(prev[x0 + y1*w], prev[x1 + y1*w]));
+            }
+        }
+    }
+}
+
+bool DepthPyramid::occluded(int xmin, int ymin, int xmax, int ymax, float depth) const {
+    if (levels.empty()) return false;
+    // The finest level where the rectangle is within 2 x 2 blocks
+    int k = 0;
+    while (k + 1 < (int)levels.size() && ((xmax >> k) - (xmin >> k) > 1 || (ymax >> k) - (ymin >> k) > 1)) k++;
+    const std::vector<float> &level = levels[k];
+    const int w = widths[k];
+    for (int y=ymin >> k; y<=(ymax >> k); y++) {
+        for (int x=xmin >> k; x<=(xmax >> k); x++) {
+            // the faces still win the depth test where they are as near
+            if (!(depth < level[x + y*w])) return false;
+        }
+    }
+    return true;
+}
+
+ClusterVisibility cluster_visibility(const Cluster &cluster, int width, int height, bool reverse_pov,
+    const DepthPyramid *hierarchical_depth, Vec2i &bboxmin, Vec2i &bboxmax) {
+    bboxmin = Vec2i(0, 0);
+    bboxmax = Vec2i(width - 1, height - 1);
+
+    // Screen rectangle of the cube around the sphere, unless some of it is behind the eye
+    const Matrix transform = Viewport*Projection*ModelView;
+    Vec2f pmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
+    Vec2f pmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+    for (int i=0; i<8; i++) {
+        Vec3f corner(i & 1 ? cluster.radius : -cluster.radius, i & 2 ? cluster.radius : -cluster.radius, i & 4 ? cluster.radius : -cluster.radius);
+        Vec4f p = transform*embed<4>(cluster.center + corner);
+        if (!(p[3] > 0)) return CLUSTER_VISIBLE;
+        for (int j=0; j<2; j++) {
+            pmin[j] = std::min(pmin[j], p[j]/p[3]);
+            pmax[j] = std::max(pmax[j], p[j]/p[3]);
+        }
+    }
+    // with a pixel more all around, for multisampling
+    if (pmax.x < -1 || pmax.y < -1 || pmin.x > width || pmin.y > height) return CLUSTER_OUTSIDE;
+    bboxmin = Vec2i(std::max(0, (int)std::floor(pmin.x) - 1), std::max(0, (int)std::floor(pmin.y) - 1));
+    bboxmax = Vec2i(std::min(width - 1, (int)std::ceil(pmax.x) + 1), std::min(height - 1, (int)std::ceil(pmax.y) + 1));
+
+    // In view space the eye is at (0, 0, -1/coeff), or infinitely far along z
+    // for coeff = 0; v is scaled by -coeff to cover both
+    Vec3f center = proj<3>(ModelView*embed<4>(cluster.center));
+    const float scale = -Projection[3][2];
+    if (cluster.cone_cutoff < 1 && scale >= 0) {
+        Vec3f axis = proj<3>(ModelView*embed<4>(cluster.cone_axis, 0.f));
+        if (reverse_pov) axis = axis*-1.f;
+        Vec3f v = center*scale - Vec3f(0, 0, 1);
+        if (axis*v > v.norm()*cluster.cone_cutoff + scale*cluster.radius*(1 + cluster.cone_cutoff)) return CLUSTER_BACKFACE;
+    }
+
+    // The depth of the fragments is their view space z
+    if (hierarchical_depth) {
+        float depth = (reverse_pov ? -center.z : center.z) + cluster.radius;
+        if (hierarchical_depth->occluded(bboxmin.x, bboxmin.y, bboxmax.x, bboxmax.y, depth)) return CLUSTER_OCCLUDED;
+    }
+    return CLUSTER_VISIBLE;
+}
+
+bool face_turned_away(const Vec3f &a, const Vec3f &b, const Vec3f &c, bool flip, bool reverse_pov) {
+    const float scale = -Projection[3][2];
+    if (scale < 0) return false;
+    Vec3f normal = proj<3>(ModelView*embed<4>(cross(b - a, c - a), 0.f));
+    if (flip != reverse_pov) normal = normal*-1.f;
+    // As for the clusters, the eye is at (0, 0, -1/scale) in view space
+    Vec3f v = proj<3>(ModelView*embed<4>(a))*scale - Vec3f(0, 0, 1);
+    return normal*v > 0;
+}
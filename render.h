@@ -27,10 +27,15 @@
 #ifndef RENDER_H_F3EC3828_8881_11EA_90FC_10FEED04CD1C
 #define RENDER_H_F3EC3828_8881_11EA_90FC_10FEED04CD1C
 
+#include <functional>
+#include <vector>
+
 #include "image.h"
 #include "geometry.h"
+#include "cluster.h"
 
 extern Matrix ModelView;
+extern Matrix Viewport;
 extern Matrix Projection;
 
 void viewport(int center_x, int center_y, int zoom_x, int zoom_y);
@@ -45,4 +50,82 @@ struct IShader {
 
 void triangle(mat<4,3,float> &pts, IShader &shader, Image &image, float *zbuffer, bool reverse_pov = false, Vec3f *normals_buffer = nullptr);
 
+// Number of coverage/depth samples per pixel for multisampling
+const int MSAA_SAMPLES = 4;
+
+// Per-sample color, depth and normal storage for multisample antialiasing.
+// Coverage and depth are tested per sample, but the fragment shader runs
+// once per pixel and its result is stored in every sample it covers.
+struct MultisampleBuffer {
+    int width;
+    int height;
+    int bytespp;
+    std::vector<float> depth;            // width*height*MSAA_SAMPLES
+    std::vector<unsigned char> color;    // width*height*MSAA_SAMPLES*bytespp
+    std::vector<Vec3f> normals;          // width*height*MSAA_SAMPLES
+
+    MultisampleBuffer(int w, int h, int bpp);
+    void clear();
+
+    // Weights the samples of every covered pixel by their coverage and writes
+    // the result to image, zbuffer (closest sample) and normals_buffer (average).
+    // The samples nothing covered show the current content of the buffers.
+    void resolve(Image &image, float *zbuffer, Vec3f *normals_buffer = nullptr);
+};
+
+void triangle(mat<4,3,float> &pts, IShader &shader, MultisampleBuffer &samples, bool reverse_pov = false);
+
+// Hook for passes that have to run at the supersampled resolution. It gets each
+// tile after rasterization and before the resolve, with scale samples per pixel
+// in each direction; the outermost scale samples are a border around the tile
+// that is not resolved but lets the pass look at its neighbours.
+typedef std::function<void(Image &tile, float *zbuffer, Vec3f *normals_buffer, int scale)> TilePass;
+
+// Renders faces [0, nfaces) of the shader with ssaa x ssaa samples per pixel.
+// The image is processed in small tiles, each one rasterized into supersampled
+// buffers and box filtered straight into image, zbuffer and normals_buffer, so
+// the whole supersampled framebuffer never exists at once. Tiles start from the
+// current content of the buffers, so pixels the model only partially covers
+// blend with what was already there.
+// When faces is given, it lists the nfaces faces to render instead.
+void render_supersampled(int nfaces, IShader &shader, int ssaa, Image &image, float *zbuffer, bool reverse_pov = false, Vec3f *normals_buffer = nullptr, const TilePass &tile_pass = TilePass(), const int *faces = nullptr);
+
+// Hierarchical depth buffer: level k keeps the farthest depth of each block of
+// 2^k x 2^k pixels, so that a whole screen rectangle can be tested at once
+class DepthPyramid {
+public:
+    // From a depth buffer with samples depths per pixel, one pixel after the other
+    void build(const float *depth, int width, int height, int samples = 1);
+    // Brings the pixels in [xmin, xmax] x [ymin, ymax] up to date after a build()
+    void update(const float *depth, int samples, int xmin, int ymin, int xmax, int ymax);
+    void clear();
+    // Whether every pixel in [xmin, xmax] x [ymin, ymax] already has something
+    // nearer than depth, which is always false before the first build()
+    bool occluded(int xmin, int ymin, int xmax, int ymax, float depth) const;
+
+private:
+    std::vector<std::vector<float> > levels;
+    std::vector<int> widths, heights;
+};
+
+enum ClusterVisibility {
+    CLUSTER_VISIBLE,
+    CLUSTER_OUTSIDE,  // out of the width x height viewport
+    CLUSTER_BACKFACE, // every face turns away from the eye
+    CLUSTER_OCCLUDED  // behind what hierarchical_depth has
+};
+
+// Whether the faces of cluster may show up in a width x height image under the
+// current ModelView, Projection and Viewport, from the bounds alone. The
+// pixels they may cover go to bboxmin and bboxmax. Faces turned towards the eye
+// are the hidden ones with reverse_pov. Occlusion is only tested when
+// hierarchical_depth is given.
+ClusterVisibility cluster_visibility(const Cluster &cluster, int width, int height, bool reverse_pov,
+    const DepthPyramid *hierarchical_depth, Vec2i &bboxmin, Vec2i &bboxmax);
+
+// Whether the face with corners a, b and c in model space turns away from the
+// eye, the test cluster_visibility() makes for all the faces of a cluster at
+// once. Its normal follows the winding, or goes the other way with flip.
+bool face_turned_away(const Vec3f &a, const Vec3f &b, const Vec3f &c, bool flip, bool reverse_pov);
+
 #endif // RENDER_H_F3EC3828_8881_11EA_90FC_10FEED04CD1C
@@ -0,0 +1,328 @@
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "simplify.h"
+
+// Sum of squared distances to a set of planes, weighted by area
+struct Quadric {
+    double a2, b2, c2, d2, ab, ac, ad, bc, bd, cd;
+    double weight;
+
+    Quadric() : a2(0), b2(0), c2(0), d2(0), ab(0), ac(0), ad(0), bc(0), bd(0), cd(0), weight(0) {}
+
+    // Plane a x + b y + c z + d = 0 with a unit normal
+    Quadric(double a, double b, double c, double d, double w) :
+        a2(a*a*w), b2(b*b*w), c2(c*c*w), d2(d*d*w), ab(a*b*w), ac(a*c*w), ad(a*d*w), bc(b*c*w), bd(b*d*w), cd(c*d*w), weight(w) {}
+
+    void add(const Quadric &q) {
+        a2 += q.a2; b2 += q.b2; c2 += q.c2; d2 += q.d2;
+        ab += q.ab; ac += q.ac; ad += q.ad; bc += q.bc; bd += q.bd; cd += q.cd;
+        weight += q.weight;
+    }
+
+    double error(const Vec3f &p) const {
+        double x = p.x, y = p.y, z = p.z;
+        double e = a2*x*x + b2*y*y + c2*z*z + d2
+            + 2 * (ab*x*y + ac*x*z + bc*y*z + ad*x + bd*y + cd*z);
+        return e > 0 ? e : 0;
+    }
+};
+
+static Quadric plane_quadric(const Vec3f &p, Vec3f n, double weight) {
+    double l = n.norm();
+    if (l <= 0) return Quadric();
+    n = n / l;
+    return Quadric(n.x, n.y, n.z, -(n * p), weight);
+}
+
+// How a vertex may move
+enum VertexKind {
+    MANIFOLD, // surrounded by triangles, goes anywhere around it
+    BORDER,   // on an open border, slides along it
+    SEAM,     // one of two vertices in the same place, slides along the seam with the other
+    LOCKED    // stays put
+};
+
+struct Collapse {
+    unsigned int v, u;   // v moves onto u
+    unsigned int v2, u2; // and on a seam the other vertex in its place too
+    double error;
+};
+
+// Triangles using each vertex, as offsets into one array
+struct Adjacency {
+    std::vector<unsigned int> offsets; // nverts + 1
+    std::vector<unsigned int> triangles;
+
+    void build(const unsigned int *indices, size_t index_count, size_t nverts) {
+        offsets.assign(nverts + 1, 0);
+        for (size_t i = 0; i < index_count; i++) offsets[indices[i] + 1]++;
+        for (size_t v = 0; v < nverts; v++) offsets[v + 1] += offsets[v];
+        triangles.resize(index_count);
+        std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < index_count; i++) triangles[fill[indices[i]]++] = (unsigned int)(i / 3);
+    }
+};
+
+// Whether moving v onto u keeps every other triangle around v facing the same way
+static bool collapse_keeps_orientation(const std::vector<unsigned int> &indices, const Adjacency &adjacency,
+    const std::vector<Vec3f> &positions, unsigned int v, unsigned int u) {
+    for (unsigned int k = adjacency.offsets[v]; k < adjacency.offsets[v + 1]; k++) {
+        const unsigned int *tri = &indices[adjacency.triangles[k] * 3];
+        if (tri[0] == u || tri[1] == u || tri[2] == u) continue; // goes away
+        int corner = tri[0] == v ? 0 : (tri[1] == v ? 1 : 2);
+        const Vec3f &a = positions[tri[(corner + 1) % 3]];
+        const Vec3f &b = positions[tri[(corner + 2) % 3]];
+        Vec3f before = cross(a - positions[v], b - positions[v]);
+        Vec3f after = cross(a - positions[u], b - positions[u]);
+        // Flipped, or turned so far it is nearly on edge
+        if (before * after <= 0.25f * sqrt((before * before) * (after * after))) return false;
+    }
+    return true;
+}
+
+// The open edges of a vertex, those no triangle runs along the other way
+struct OpenEdges {
+    unsigned int count; // leaving and entering
+    unsigned int next;  // where the one leaving goes
+    unsigned int prev;  // and where the one entering comes from
+
+    OpenEdges() : count(0), next(~0u), prev(~0u) {}
+};
+
+// Finds the open edges of the triangles in tris, which may number vertices
+// or places
+static void find_open_edges(const std::vector<unsigned int> &tris, size_t index_count, size_t n, std::vector<OpenEdges> &open) {
+    Adjacency adjacency;
+    adjacency.build(tris.data(), index_count, n);
+    open.assign(n, OpenEdges());
+    for (size_t i = 0; i < index_count; i++) {
+        unsigned int a = tris[i], b = tris[i - i % 3 + (i + 1) % 3];
+        bool found = false;
+        for (unsigned int j = adjacency.offsets[b]; j < adjacency.offsets[b + 1] && !found; j++) {
+            const unsigned int *other = &tris[adjacency.triangles[j] * 3];
+            found = (other[0] == b && other[1] == a) || (other[1] == b && other[2] == a) || (other[2] == b && other[0] == a);
+        }
+        if (!found) {
+            open[a].count++;
+            open[a].next = b;
+            open[b].count++;
+            open[b].prev = a;
+        }
+    }
+}
+
+// Lets the open edges of v run to u once v has moved onto it
+static void reroute_open_edges(std::vector<OpenEdges> &open, unsigned int v, unsigned int u) {
+    if (open[v].next == u) {
+        if (open[v].prev != ~0u) open[open[v].prev].next = u;
+        open[u].prev = open[v].prev;
+    } else if (open[v].prev == u) {
+        if (open[v].next != ~0u) open[open[v].next].prev = u;
+        open[u].next = open[v].next;
+    }
+}
+
+size_t simplify(unsigned int *destination, const unsigned int *indices, size_t index_count, const Vec3f *verts,
+    size_t target_index_count, float target_error, bool lock_border, float *result_error) {
+    index_count = index_count / 3 * 3;
+    double max_error = 0;
+
+    // Work on the vertices used, numbered from 0
+    std::vector<unsigned int> used(indices, indices + index_count);
+    std::sort(used.begin(), used.end());
+    used.erase(std::unique(used.begin(), used.end()), used.end());
+    const size_t nverts = used.size();
+    std::vector<unsigned int> tris(index_count);
+    for (size_t i = 0; i < index_count; i++) {
+        tris[i] = (unsigned int)(std::lower_bound(used.begin(), used.end(), indices[i]) - used.begin());
+    }
+    std::vector<Vec3f> positions(nverts);
+    for (size_t v = 0; v < nverts; v++) positions[v] = verts[used[v]];
+
+    // Vertices in the same place, which differ in their other attributes
+    std::vector<unsigned int> place(nverts);
+    std::vector<unsigned int> place_count;
+    std::vector<unsigned int> wedge(nverts); // the next vertex in the same place
+    {
+        std::unordered_map<PositionKey, unsigned int, PositionKeyHash> places;
+        std::vector<unsigned int> last;
+        places.reserve(nverts);
+        for (size_t v = 0; v < nverts; v++) {
+            std::pair<std::unordered_map<PositionKey, unsigned int, PositionKeyHash>::iterator, bool> found =
+                places.insert(std::make_pair(PositionKey(positions[v]), (unsigned int)place_count.size()));
+            place[v] = found.first->second;
+            if (found.second) {
+                place_count.push_back(0);
+                last.push_back((unsigned int)v);
+                wedge[v] = (unsigned int)v;
+            } else {
+                wedge[v] = wedge[last[place[v]]];
+                wedge[last[place[v]]] = (unsigned int)v;
+                last[place[v]] = (unsigned int)v;
+            }
+            place_count[place[v]]++;
+        }
+    }
+    const size_t nplaces = place_count.size();
+
+    // Open edges between places are borders of the surface, open edges
+    // between vertices that are not borders are seams
+    std::vector<OpenEdges> open, border;
+    find_open_edges(tris, index_count, nverts, open);
+    {
+        std::vector<unsigned int> place_tris(index_count);
+        for (size_t i = 0; i < index_count; i++) place_tris[i] = place[tris[i]];
+        find_open_edges(place_tris, index_count, nplaces, border);
+    }
+
+    std::vector<unsigned char> kind(nverts, LOCKED);
+    for (size_t v = 0; v < nverts; v++) {
+        const OpenEdges &b = border[place[v]];
+        const OpenEdges &o = open[v];
+        bool simple = o.count == 0 || (o.count == 2 && o.next != ~0u && o.prev != ~0u);
+        if (place_count[place[v]] == 1) {
+            if (o.count == 0) kind[v] = MANIFOLD;
+            else if (simple && b.count == 2 && !lock_border) kind[v] = BORDER;
+        } else if (place_count[place[v]] == 2 && b.count == 0) {
+            const OpenEdges &w = open[wedge[v]];
+            if (simple && o.count == 2 && w.count == 2 && w.next != ~0u && w.prev != ~0u) kind[v] = SEAM;
+        }
+    }
+
+    // Planes of the triangles around each place, and planes standing on the
+    // borders and seams so that they keep their shape
+    std::vector<Quadric> quadrics(nplaces);
+    for (size_t t = 0; t < index_count / 3; t++) {
+        const unsigned int *tri = &tris[t * 3];
+        Vec3f n = cross(positions[tri[1]] - positions[tri[0]], positions[tri[2]] - positions[tri[0]]);
+        double area = n.norm() / 2;
+        Quadric q = plane_quadric(positions[tri[0]], n, area);
+        for (int k = 0; k < 3; k++) {
+            quadrics[place[tri[k]]].add(q);
+            unsigned int a = tri[k], b = tri[(k + 1) % 3];
+            if (open[a].next == b) {
+                Vec3f edge = positions[b] - positions[a];
+                Quadric side = plane_quadric(positions[a], cross(edge, n), (edge * edge) * 10);
+                quadrics[place[a]].add(side);
+                quadrics[place[b]].add(side);
+            }
+        }
+    }
+
+    double error_limit = (double)target_error * target_error;
+    Adjacency adjacency;
+    std::vector<unsigned int> remap(nverts);
+    std::vector<unsigned char> locked(nverts);
+    std::vector<Collapse> collapses;
+    std::vector<unsigned int> order;
+    std::vector<double> errors;
+    bool widen = false;
+
+    while (index_count > target_index_count) {
+        // Every way an edge can collapse, with what it costs; edges inside
+        // the surface are seen from the triangles on both sides, take one
+        collapses.clear();
+        for (size_t i = 0; i < index_count; i++) {
+            unsigned int v = tris[i];
+            unsigned int u = tris[i - i % 3 + (i + 1) % 3];
+            if (v > u && open[v].next != u) continue;
+            for (int dir = 0; dir < 2; dir++, std::swap(u, v)) {
+                Collapse c;
+                c.v = v;
+                c.u = u;
+                c.v2 = c.u2 = ~0u;
+                bool along = open[v].next == u || open[v].prev == u;
+                if (kind[v] == BORDER || kind[v] == SEAM) {
+                    if (!along) continue;
+                } else if (kind[v] != MANIFOLD) {
+                    continue;
+                }
+                if (kind[v] == SEAM) {
+                    // The other side of the seam moves along with it
+                    unsigned int v2 = wedge[v];
+                    unsigned int next = open[v2].next, prev = open[v2].prev;
+                    if (place[next] == place[u]) c.u2 = next;
+                    else if (place[prev] == place[u]) c.u2 = prev;
+                    else continue;
+                    c.v2 = v2;
+                }
+                Quadric q = quadrics[place[v]];
+                q.add(quadrics[place[u]]);
+                c.error = q.weight > 0 ? q.error(positions[u]) / q.weight : 0;
+                collapses.push_back(c);
+            }
+        }
+        if (collapses.empty()) break;
+
+        // Only the cheaper part of the collapses is tried in a pass, so that
+        // the ones left are priced again once the surface around them has
+        // changed; about two collapses per triangle to remove, but not so few
+        // that passes get nothing done
+        size_t goal = (index_count - target_index_count) / 3;
+        size_t take = std::max(std::min(goal * 2, collapses.size() / 8), collapses.size() / 32);
+        take = std::max<size_t>(1, std::min(take, collapses.size()));
+        if (widen) take = collapses.size();
+        errors.resize(collapses.size());
+        for (size_t i = 0; i < collapses.size(); i++) errors[i] = collapses[i].error;
+        std::nth_element(errors.begin(), errors.begin() + (take - 1), errors.end());
+        double pass_limit = std::min(error_limit, errors[take - 1]);
+        order.clear();
+        for (size_t i = 0; i < collapses.size(); i++) {
+            if (collapses[i].error <= pass_limit) order.push_back((unsigned int)i);
+        }
+        std::sort(order.begin(), order.end(), [&collapses](unsigned int a, unsigned int b) {
+            return collapses[a].error < collapses[b].error;
+        });
+
+        // Cheapest first, touching each neighbourhood once per pass
+        adjacency.build(tris.data(), index_count, nverts);
+        for (size_t v = 0; v < nverts; v++) remap[v] = (unsigned int)v;
+        std::fill(locked.begin(), locked.end(), 0);
+        size_t removed = 0;
+        for (size_t i = 0; i < order.size() && removed < goal; i++) {
+            const Collapse &c = collapses[order[i]];
+            if (locked[c.v] || locked[c.u]) continue;
+            if (c.v2 != ~0u && (locked[c.v2] || locked[c.u2])) continue;
+            if (!collapse_keeps_orientation(tris, adjacency, positions, c.v, c.u)) continue;
+            if (c.v2 != ~0u && !collapse_keeps_orientation(tris, adjacency, positions, c.v2, c.u2)) continue;
+
+            for (int side = 0; side < 2; side++) {
+                unsigned int v = side ? c.v2 : c.v, u = side ? c.u2 : c.u;
+                if (v == ~0u) break;
+                for (unsigned int k = adjacency.offsets[v]; k < adjacency.offsets[v + 1]; k++) {
+                    const unsigned int *tri = &tris[adjacency.triangles[k] * 3];
+                    if (tri[0] == u || tri[1] == u || tri[2] == u) removed++;
+                    for (int m = 0; m < 3; m++) locked[tri[m]] = 1;
+                }
+                remap[v] = u;
+                reroute_open_edges(open, v, u);
+            }
+            quadrics[place[c.u]].add(quadrics[place[c.v]]);
+            max_error = std::max(max_error, c.error);
+        }
+        if (!removed) {
+            // None of the cheap ones could go, try them all before giving up
+            if (widen || take == collapses.size()) break;
+            widen = true;
+            continue;
+        }
+        widen = false;
+
+        // Drop the triangles that lost their area
+        size_t count = 0;
+        for (size_t i = 0; i < index_count; i += 3) {
+            unsigned int a = remap[tris[i]], b = remap[tris[i + 1]], c = remap[tris[i + 2]];
+            if (a == b || b == c || a == c) continue;
+            tris[count++] = a;
+            tris[count++] = b;
+            tris[count++] = c;
+        }
+        index_count = count;
+    }
+
+    for (size_t i = 0; i < index_count; i++) destination[i] = used[tris[i]];
+    if (result_error) *result_error = (float)sqrt(max_error);
+    return index_count;
+}
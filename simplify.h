@@ -0,0 +1,49 @@
+/*
+ * Tiny Renderer, https://github.com/ssloy/tinyrenderer
+ * Copyright Dmitry V. Sokolov
+ * zlib license
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not
+ *    be misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+#pragma once
+
+#ifndef SIMPLIFY_H_FB9A77CC_CB5C_11F1_9159_02FC00000001
+#define SIMPLIFY_H_FB9A77CC_CB5C_11F1_9159_02FC00000001
+
+#include <stddef.h>
+
+#include "geometry.h"
+
+// Reduces the triangles in indices by collapsing edges, each time moving a
+// vertex onto one of its neighbours, cheapest first by the quadric error
+// metric. Stops once no more than target_index_count indices are left or
+// when the next collapse would move the surface further than target_error,
+// in model units. Vertices are never moved or added, so the result indexes
+// verts like the input does. Vertices on open borders stay in place when
+// lock_border is set. Two vertices sharing their position make a seam and
+// collapse as a pair along it, so that it does not open up; vertices in a
+// place shared by more than two, or where a seam meets an open border, stay
+// in place. Returns the number of indices written to destination, which may
+// be the same array as indices, and the largest error of the collapses done
+// in result_error.
+size_t simplify(unsigned int *destination, const unsigned int *indices, size_t index_count, const Vec3f *verts,
+    size_t target_index_count, float target_error, bool lock_border = false, float *result_error = NULL);
+
+#endif // SIMPLIFY_H_FB9A77CC_CB5C_11F1_9159_02FC00000001
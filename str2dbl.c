@@ -30,10 +30,15 @@
 /* Therefore it cannot be used as a direct drop-in replacement, as in   */
 /* some cases results will be different on the least significant bit of */
 /* mantissa. Read more in the README.md file.                           */
+/*                                                                      */
+/* Numbers with a mantissa below 2^53 and a power of ten exponent of at */
+/* most 22 take a fast path instead: both are exact doubles, so a single*/
+/* multiplication or division gives the correctly rounded result.       */
 /*======================================================================*/
 
 // https://github.com/grzegorz-kraszewski/stringtofloat/
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -168,8 +173,9 @@ struct PrepNumber
 #define GETC(s) *s++
 
 
-static int parser(const char *s, struct PrepNumber *pn)
+static int parser(const char *s, struct PrepNumber *pn, const char **end)
 {
+	const char *last = NULL;          /* one past the last character of the number */
 	int state = FSM_A;
 	int digx = 0, c = ' ';            /* initial value for kicking off the state machine */
 	int result = PARSER_OK;
@@ -200,7 +206,11 @@ static int parser(const char *s, struct PrepNumber *pn)
 			break;
 
 			case FSM_C:
-				if (c == '0') c = GETC(s);
+				if (c == '0')
+				{
+					c = GETC(s);
+					last = s - 1;
+				}
 				else if (c == DPOINT)
 				{
 					c = GETC(s);
@@ -213,6 +223,7 @@ static int parser(const char *s, struct PrepNumber *pn)
 				if (c == '0')
 				{
 					c = GETC(s);
+					last = s - 1;
 					if (pn->exponent > -2147483647) pn->exponent--;
 				}
 				else state = FSM_F;
@@ -230,6 +241,7 @@ static int parser(const char *s, struct PrepNumber *pn)
 					else if (pn->exponent < 2147483647) pn->exponent++;
 
 					c = GETC(s);
+					last = s - 1;
 				}
 				else if (c == DPOINT)
 				{
@@ -251,6 +263,7 @@ static int parser(const char *s, struct PrepNumber *pn)
 					}
 
 					c = GETC(s);
+					last = s - 1;
 				}
 				else if (ISEXP(c))
 				{
@@ -272,7 +285,11 @@ static int parser(const char *s, struct PrepNumber *pn)
 			break;
 
 			case FSM_H:
-				if (c == '0') c = GETC(s);
+				if (c == '0')
+				{
+					c = GETC(s);
+					if (last) last = s - 1;
+				}
 				else state = FSM_I;
 			break;
 
@@ -286,12 +303,15 @@ static int parser(const char *s, struct PrepNumber *pn)
 					}
 
 					c = GETC(s);
+					if (last) last = s - 1;
 				}
 				else state = FSM_STOP;
 			break;
 		}
 	}
 
+	if (end) *end = last;
+
 	if (expneg) expexp = -expexp;
 	pn->exponent += expexp;
 
@@ -315,6 +335,13 @@ static int parser(const char *s, struct PrepNumber *pn)
 }
 
 
+static const double exact_powers_of_ten[] =
+{
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
 static double converter(struct PrepNumber *pn)
 {
 	int binexp = 92;
@@ -417,24 +444,36 @@ static double converter(struct PrepNumber *pn)
 }
 
 
-double str2dbl(const char *s)
+/* Like str2dbl(), but also sets *end to the first character after the
+   number, or to s when there is none, the same as strtod() does. */
+
+double str2dbl_end(const char *s, const char **end)
 {
 	struct PrepNumber pn;
+	const char *last;
 	union HexDouble hd;
 	int i;
-	double result;
+	double result = 0;
 
 	pn.mantissa = 0;
 	pn.negative = 0;
 	pn.exponent = 0;
 	hd.u = DOUBLE_PLUS_ZERO;
 
-	i = parser(s, &pn);
+	i = parser(s, &pn, &last);
+	if (end) *end = last ? last : s;
 
 	switch (i)
 	{
 		case PARSER_OK:
-			result = converter(&pn);
+			if ((pn.mantissa >> 53) == 0 && pn.exponent >= -22 && pn.exponent <= 22)
+			{
+				result = (double)pn.mantissa;
+				if (pn.exponent < 0) result /= exact_powers_of_ten[-pn.exponent];
+				else result *= exact_powers_of_ten[pn.exponent];
+				if (pn.negative) result = -result;
+			}
+			else result = converter(&pn);
 		break;
 
 		case PARSER_PZERO:
@@ -460,6 +499,11 @@ double str2dbl(const char *s)
 	return result;
 }
 
+double str2dbl(const char *s)
+{
+	return str2dbl_end(s, NULL);
+}
+
 #ifdef __cplusplus
 }
 #endif
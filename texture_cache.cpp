@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <algorithm>
+
+#include "texture_cache.h"
+#include "parallel.h"
+
+TextureCache &TextureCache::shared() {
+    static TextureCache cache;
+    return cache;
+}
+
+static std::shared_future<Texture> ready(Texture texture) {
+    std::promise<Texture> promise;
+    promise.set_value(texture);
+    return promise.get_future().share();
+}
+
+// Disk cache: one file per texture and size, holding a header followed by the
+// decoded and flipped pixels, so that it can be mapped straight into an Image
+
+static const char TEXTURE_FILE_MAGIC[4] = { 'T', 'R', 'T', 'X' };
+static const uint32_t TEXTURE_FILE_VERSION = 1;
+
+struct TextureFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytespp;
+    int32_t max_size;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+    unsigned char reserved[16]; // keeps the pixels 64 byte aligned
+};
+
+static_assert(sizeof(TextureFileHeader) == 64, "TextureFileHeader must be 64 bytes");
+
+struct SourceInfo {
+    std::string path;
+    uint64_t size;
+    int64_t mtime;
+};
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool hash_file(const std::string &filename, uint64_t &hash) {
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp) return false;
+    unsigned char buffer[65536];
+    size_t n;
+    hash = fnv1a(NULL, 0);
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        hash = fnv1a(buffer, n, hash);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+static std::string cache_filename(const std::string &dir, const SourceInfo &source, int max_size) {
+    uint64_t hash = fnv1a(source.path.c_str(), source.path.size() + 1);
+    hash = fnv1a(&max_size, sizeof(max_size), hash);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.tex", (unsigned long long)hash);
+    return dir + "/" + name;
+}
+
+// Maps a cached texture, provided it was made from the same source. A source
+// with a different mtime is still accepted if its contents hash the same, and
+// the new mtime is written back so that it is not hashed again next time.
+static Texture map_cached(const std::string &filename, const SourceInfo &source, int max_size) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return Texture();
+    struct stat sb;
+    void *base = MAP_FAILED;
+    if (!fstat(fd, &sb) && sb.st_size >= (off_t)sizeof(TextureFileHeader)) {
+        base = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) return Texture();
+
+    size_t length = sb.st_size;
+    const TextureFileHeader *header = (const TextureFileHeader *)base;
+    bool valid = !memcmp(header->magic, TEXTURE_FILE_MAGIC, sizeof(header->magic))
+        && header->version == TEXTURE_FILE_VERSION
+        && header->max_size == max_size
+        && header->source_size == source.size
+        && header->width > 0 && header->height > 0
+        && (header->bytespp == 1 || header->bytespp == 3 || header->bytespp == 4)
+        && length == sizeof(TextureFileHeader) + (size_t)header->width * header->height * header->bytespp;
+    if (valid && header->source_mtime != source.mtime) {
+        uint64_t hash;
+        valid = hash_file(source.path, hash) && hash == header->source_hash;
+        if (valid) {
+            // Best effort, the cache may well be read only
+            int wfd = open(filename.c_str(), O_WRONLY);
+            if (wfd >= 0) {
+                ssize_t n = pwrite(wfd, &source.mtime, sizeof(source.mtime), offsetof(TextureFileHeader, source_mtime));
+                (void)n;
+                close(wfd);
+            }
+        }
+    }
+    if (!valid) {
+        munmap(base, length);
+        return Texture();
+    }
+
+    std::shared_ptr<Image> img = std::make_shared<Image>();
+    img->adopt((unsigned char *)base + sizeof(TextureFileHeader), header->width, header->height, header->bytespp,
+        [base, length](unsigned char *) { munmap(base, length); });
+    return img;
+}
+
+// Written to a temporary file first, so that concurrent processes never map a partial one
+static bool store_cached(const std::string &filename, const SourceInfo &source, int max_size, const Image &img) {
+    TextureFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TEXTURE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TEXTURE_FILE_VERSION;
+    header.width = img.get_width();
+    header.height = img.get_height();
+    header.bytespp = img.get_bytespp();
+    header.max_size = max_size;
+    header.source_size = source.size;
+    header.source_mtime = source.mtime;
+    if (!hash_file(source.path, header.source_hash)) return false;
+
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long)getpid());
+    std::string tmpname = filename + suffix;
+    FILE *fp = fopen(tmpname.c_str(), "wb");
+    if (!fp) return false;
+    size_t nbytes = (size_t)header.width * header.height * header.bytespp;
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+        && fwrite(img.buffer(), 1, nbytes, fp) == nbytes;
+    ok = !fclose(fp) && ok;
+    if (ok) ok = !rename(tmpname.c_str(), filename.c_str());
+    if (!ok) unlink(tmpname.c_str());
+    return ok;
+}
+
+static Texture decode(const SourceInfo &source, int max_size, const std::string &cache_dir) {
+    std::string cached;
+    if (!cache_dir.empty()) {
+        cached = cache_filename(cache_dir, source, max_size);
+        Texture texture = map_cached(cached, source, max_size);
+        if (texture) return texture;
+    }
+
+    std::shared_ptr<Image> img = std::make_shared<Image>();
+    if (!img->read_from_file(source.path.c_str(), true)) return Texture();
+    if (max_size > 0) {
+        int w = img->get_width();
+        int h = img->get_height();
+        while (std::max(w, h) > max_size) {
+            w = std::max(1, w / 2);
+            h = std::max(1, h / 2);
+        }
+        if ((w != img->get_width() || h != img->get_height()) && !img->scale(w, h, Image::BOX)) return Texture();
+    }
+
+    if (!cached.empty()) store_cached(cached, source, max_size, *img);
+    return img;
+}
+
+void TextureCache::set_disk_cache(const std::string &dir) {
+    std::lock_guard<std::mutex> lock(mutex);
+    disk_cache_dir = dir;
+}
+
+std::shared_future<Texture> TextureCache::request(const std::string &filename, int max_size) {
+    char canonical[PATH_MAX];
+    struct stat sb;
+    if (!realpath(filename.c_str(), canonical) || stat(canonical, &sb)) {
+        return ready(Texture());
+    }
+    SourceInfo source;
+    source.path = canonical;
+    source.size = sb.st_size;
+    source.mtime = (int64_t)sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+
+    if (max_size < 0) max_size = 0;
+    Key key(canonical, max_size);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<Key, Entry>::iterator it = entries.find(key);
+    if (it != entries.end() && it->second.mtime == source.mtime) {
+        return it->second.texture;
+    }
+
+    // New, or the file changed since it was decoded
+    std::string cache_dir = disk_cache_dir;
+    Entry entry;
+    entry.mtime = source.mtime;
+    entry.texture = ThreadPool::shared().submit([source, max_size, cache_dir]() {
+        return decode(source, max_size, cache_dir);
+    }).share();
+    entries[key] = entry;
+    return entry.texture;
+}
+
+Texture TextureCache::get(const std::string &filename, int max_size) {
+    return request(filename, max_size).get();
+}
+
+void TextureCache::purge() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (std::map<Key, Entry>::iterator it = entries.begin(); it != entries.end(); ) {
+        const std::shared_future<Texture> &texture = it->second.texture;
+        bool done = texture.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        if (done && texture.get().use_count() <= 1) {
+            it = entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void TextureCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+}
@@ -0,0 +1,84 @@
+/*
+ * Tiny Renderer, https://github.com/ssloy/tinyrenderer
+ * Copyright Dmitry V. Sokolov
+ * zlib license
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not
+ *    be misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#pragma once
+
+#ifndef TEXTURE_CACHE_H_FB9A7650_CB5C_11F1_9159_02FC00000001
+#define TEXTURE_CACHE_H_FB9A7650_CB5C_11F1_9159_02FC00000001
+
+#include <string>
+#include <map>
+#include <memory>
+#include <future>
+#include <mutex>
+
+#include "image.h"
+
+// Textures are shared between every model that uses them, so they are read only
+typedef std::shared_ptr<const Image> Texture;
+
+// Process-wide cache of decoded textures, keyed by the canonical path, the
+// modification time of the file and the resolution it was reduced to, so
+// that every texture is decoded and kept in memory once no matter how many
+// meshes, models or jobs use it.
+class TextureCache {
+public:
+    static TextureCache &shared();
+
+    // Starts decoding filename on the shared thread pool unless it is already
+    // cached or on its way. The texture is flipped so that row 0 is v = 0.
+    // With max_size > 0 it is halved until its largest side is no more than
+    // max_size texels, and only that level is kept.
+    // Resolves to an empty Texture when the file cannot be read.
+    std::shared_future<Texture> request(const std::string &filename, int max_size = 0);
+
+    // Same as request(), but waits for the texture
+    Texture get(const std::string &filename, int max_size = 0);
+
+    // Keeps decoded textures in dir as raw files, mapped instead of decoded
+    // by later runs as long as their source is unchanged. Empty disables it.
+    void set_disk_cache(const std::string &dir);
+
+    // Forgets the textures nobody else holds a reference to
+    void purge();
+    void clear();
+
+private:
+    TextureCache() {}
+    TextureCache(const TextureCache &);
+    TextureCache & operator =(const TextureCache &);
+
+    struct Entry {
+        long long mtime;
+        std::shared_future<Texture> texture;
+    };
+
+    std::mutex mutex;
+    typedef std::pair<std::string, int> Key; // canonical path, max_size
+    std::map<Key, Entry> entries;
+    std::string disk_cache_dir;
+};
+
+#endif // TEXTURE_CACHE_H_FB9A7650_CB5C_11F1_9159_02FC00000001
@@ -0,0 +1,118 @@
+#include <string.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "vertex_cache.h"
+
+// The vertices of indices numbered from 0, in local, and how many there are
+static size_t local_vertices(std::vector<unsigned int> &local, const unsigned int *indices, size_t index_count) {
+    std::vector<unsigned int> sorted(indices, indices + index_count);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+    local.resize(index_count);
+    for (size_t i = 0; i < index_count; i++) {
+        local[i] = std::lower_bound(sorted.begin(), sorted.end(), indices[i]) - sorted.begin();
+    }
+    return sorted.size();
+}
+
+float vertex_cache_acmr(const unsigned int *indices, size_t index_count, unsigned int cache_size) {
+    if (index_count < 3) return 0;
+    std::vector<unsigned int> local;
+    size_t nverts = local_vertices(local, indices, index_count);
+
+    // A vertex is in the cache while fewer than cache_size others came in after it
+    std::vector<unsigned int> stamps(nverts, 0);
+    unsigned int time = cache_size + 1;
+    size_t misses = 0;
+    for (size_t i = 0; i < index_count; i++) {
+        unsigned int v = local[i];
+        if (time - stamps[v] > cache_size) {
+            stamps[v] = time++;
+            misses++;
+        }
+    }
+    return (float)misses / (index_count / 3);
+}
+
+void optimize_vertex_cache(unsigned int *destination, const unsigned int *indices, size_t index_count, unsigned int cache_size) {
+    const size_t nfaces = index_count / 3;
+    if (nfaces == 0) return;
+    std::vector<unsigned int> local;
+    const size_t nverts = local_vertices(local, indices, nfaces * 3);
+
+    // Faces using each vertex, and how many of them are still to be written
+    std::vector<unsigned int> offsets(nverts + 1, 0);
+    for (size_t i = 0; i < nfaces * 3; i++) offsets[local[i] + 1]++;
+    for (size_t v = 0; v < nverts; v++) offsets[v + 1] += offsets[v];
+    std::vector<unsigned int> live(nverts);
+    for (size_t v = 0; v < nverts; v++) live[v] = offsets[v + 1] - offsets[v];
+    std::vector<unsigned int> adjacent(nfaces * 3);
+    std::vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < nfaces * 3; i++) adjacent[fill[local[i]]++] = i / 3;
+
+    std::vector<unsigned int> stamps(nverts, 0);
+    std::vector<bool> emitted(nfaces, false);
+    std::vector<unsigned int> dead_end; // vertices of the faces written, latest on top
+    std::vector<unsigned int> candidates;
+    std::vector<unsigned int> result;
+    result.reserve(nfaces * 3);
+    unsigned int time = cache_size + 1;
+    size_t cursor = 0;
+    int fanning = local[0];
+
+    while (fanning >= 0) {
+        // Every face left around the fanning vertex
+        candidates.clear();
+        for (unsigned int k = offsets[fanning]; k < offsets[fanning + 1]; k++) {
+            unsigned int f = adjacent[k];
+            if (emitted[f]) continue;
+            emitted[f] = true;
+            for (int j = 0; j < 3; j++) {
+                unsigned int v = local[f * 3 + j];
+                result.push_back(indices[f * 3 + j]);
+                dead_end.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (time - stamps[v] > cache_size) stamps[v] = time++;
+            }
+        }
+
+        // Next, the vertex that has been in the cache the longest and is sure
+        // to still be there after its faces are written
+        int next = -1, best = 0;
+        for (unsigned int i = 0; i < candidates.size(); i++) {
+            unsigned int v = candidates[i];
+            if (live[v] == 0) continue;
+            int priority = 0;
+            if (time - stamps[v] + 2 * live[v] <= cache_size) priority = time - stamps[v];
+            if (priority > best) {
+                best = priority;
+                next = v;
+            }
+        }
+        // Or, at a dead end, a recent vertex with faces left, or any one
+        while (next < 0 && !dead_end.empty()) {
+            unsigned int v = dead_end.back();
+            dead_end.pop_back();
+            if (live[v] > 0) next = v;
+        }
+        while (next < 0 && cursor < nverts) {
+            if (live[cursor] > 0) next = cursor;
+            cursor++;
+        }
+        fanning = next;
+    }
+
+    memcpy(destination, result.data(), result.size() * sizeof(unsigned int));
+}
+
+size_t optimize_vertex_fetch_remap(unsigned int *remap, const unsigned int *indices, size_t index_count, size_t nverts) {
+    memset(remap, 0xff, nverts * sizeof(unsigned int));
+    unsigned int next = 0;
+    for (size_t i = 0; i < index_count; i++) {
+        if (remap[indices[i]] == ~0u) remap[indices[i]] = next++;
+    }
+    return next;
+}
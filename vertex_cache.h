@@ -0,0 +1,52 @@
+/*
+ * Tiny Renderer, https://github.com/ssloy/tinyrenderer
+ * Copyright Dmitry V. Sokolov
+ * zlib license
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ * 1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ * 2. Altered source versions must be plainly marked as such, and must not
+ *    be misrepresented as being the original software.
+ *
+ * 3. This notice may not be removed or altered from any source distribution.
+ */
+
+
+#pragma once
+
+#ifndef VERTEX_CACHE_H_FB9A790C_CB5C_11F1_9159_02FC00000001
+#define VERTEX_CACHE_H_FB9A790C_CB5C_11F1_9159_02FC00000001
+
+#include <stddef.h>
+
+// Vertices kept by the transformed vertex cache the face order is made for,
+// first in first out
+const unsigned int VERTEX_CACHE_SIZE = 16;
+
+// Average number of vertices shaded per face with a cache of cache_size
+// vertices, first in first out: between 0.5 and 3, the lower the better
+float vertex_cache_acmr(const unsigned int *indices, size_t index_count, unsigned int cache_size = VERTEX_CACHE_SIZE);
+
+// Reorders the faces in indices so that the vertices they share are still in
+// a cache of cache_size vertices when the faces come (Tipsify, Sander et al.,
+// "Fast triangle reordering for vertex locality and reduced overdraw", 2007).
+// Writes the faces to destination, which may be the same array as indices.
+void optimize_vertex_cache(unsigned int *destination, const unsigned int *indices, size_t index_count,
+    unsigned int cache_size = VERTEX_CACHE_SIZE);
+
+// Numbers the nverts vertices in the order indices first uses them, in
+// remap, with ~0u for the ones it never uses. Returns how many it uses.
+size_t optimize_vertex_fetch_remap(unsigned int *remap, const unsigned int *indices, size_t index_count, size_t nverts);
+
+#endif // VERTEX_CACHE_H_FB9A790C_CB5C_11F1_9159_02FC00000001